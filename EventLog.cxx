@@ -0,0 +1,223 @@
+#include "EventLog.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+const std::size_t EventLog::RING_SIZE;
+const std::size_t EventLog::BATCH_SIZE;
+
+namespace {
+const useconds_t WRITER_IDLE_US = 200;
+
+long long nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+}
+
+EventLog::EventLog(const std::string &path, Durability durability,
+                   unsigned int sync_interval_ms)
+        : durability(durability), sync_interval_ms(sync_interval_ms),
+          enqueue_pos(0), dequeue_pos(0), written_count(0), synced_count(0),
+          stopping(false) {
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        throw std::runtime_error(path + ": " + std::strerror(errno));
+    }
+    ring = new Slot[RING_SIZE];
+    for (std::size_t i = 0; i < RING_SIZE; ++i) {
+        ring[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    pthread_create(&writer_thread, nullptr, writerFunc, this);
+}
+
+EventLog::~EventLog() {
+    stopping.store(true);
+    pthread_join(writer_thread, nullptr);
+    close(fd);
+    delete[] ring;
+}
+
+/*
+ * A bounded multi-producer ring: each slot's sequence number tells whether
+ * it is free for the producer at position pos (sequence == pos) or holds an
+ * event for the writer (sequence == pos + 1).
+ */
+void EventLog::append(EventType type, int id, int value, int fake_id) {
+    std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    Slot *slot;
+    while (true) {
+        slot = &ring[pos & (RING_SIZE - 1)];
+        std::size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        auto diff = static_cast<long>(sequence) - static_cast<long>(pos);
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                                  std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // the ring is full, let the writer catch up
+            sched_yield();
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    slot->event.type = type;
+    slot->event.id = id;
+    slot->event.value = value;
+    slot->event.fake_id = fake_id;
+    slot->sequence.store(pos + 1, std::memory_order_release);
+}
+
+void EventLog::flush() {
+    std::size_t target = enqueue_pos.load(std::memory_order_acquire);
+    while (synced_count.load(std::memory_order_acquire) < target) {
+        usleep(WRITER_IDLE_US);
+    }
+}
+
+void *EventLog::writerFunc(void *arg) {
+    static_cast<EventLog *>(arg)->writerLoop();
+    return nullptr;
+}
+
+std::size_t EventLog::drain(std::vector<Event> *batch) {
+    batch->clear();
+    while (batch->size() < BATCH_SIZE) {
+        Slot *slot = &ring[dequeue_pos & (RING_SIZE - 1)];
+        std::size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        if (sequence != dequeue_pos + 1) break;
+        batch->push_back(slot->event);
+        slot->sequence.store(dequeue_pos + RING_SIZE,
+                             std::memory_order_release);
+        dequeue_pos++;
+    }
+    return batch->size();
+}
+
+void EventLog::writeBatch(const std::vector<Event> &batch) {
+    const char *data = reinterpret_cast<const char *>(batch.data());
+    std::size_t remaining = batch.size() * sizeof(Event);
+    while (remaining > 0) {
+        ssize_t written = write(fd, data, remaining);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            // the log is best effort, the factory must not stop because of it
+            break;
+        }
+        data += written;
+        remaining -= written;
+    }
+}
+
+void EventLog::writerLoop() {
+    std::vector<Event> batch;
+    batch.reserve(BATCH_SIZE);
+    long long last_sync_ms = nowMs();
+    while (true) {
+        bool stop = stopping.load(std::memory_order_acquire);
+        std::size_t drained = drain(&batch);
+        if (drained > 0) {
+            writeBatch(batch);
+            written_count.fetch_add(drained, std::memory_order_release);
+        }
+        std::size_t written = written_count.load(std::memory_order_relaxed);
+        std::size_t pending = enqueue_pos.load(std::memory_order_acquire);
+        std::size_t synced = synced_count.load(std::memory_order_relaxed);
+        bool must_sync = written > synced &&
+                         (durability == SYNC_EVERY_BATCH ||
+                          (durability == SYNC_PERIODIC &&
+                           nowMs() - last_sync_ms >= sync_interval_ms) ||
+                          drained == 0 || stop);
+        if (must_sync) {
+            if (durability != NO_SYNC) fdatasync(fd);
+            last_sync_ms = nowMs();
+            synced_count.store(written, std::memory_order_release);
+        }
+        if (stop && written == pending) break;
+        if (drained == 0) usleep(WRITER_IDLE_US);
+    }
+}
+
+long EventLog::replay(const std::string &path,
+                      std::list<Product> *available_products,
+                      std::list<std::pair<Product, int>> *stolen_products) {
+    int in = open(path.c_str(), O_RDONLY);
+    if (in < 0) return -1;
+    std::vector<Event> batch(BATCH_SIZE);
+    long replayed = 0;
+    bool corrupted = false;
+    while (!corrupted) {
+        ssize_t bytes = read(in, batch.data(), BATCH_SIZE * sizeof(Event));
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) break;
+        // a torn record at the end of the log is dropped
+        std::size_t events = bytes / sizeof(Event);
+        for (std::size_t i = 0; i < events && !corrupted; ++i) {
+            const Event &event = batch[i];
+            Product product(event.id, event.value);
+            switch (event.type) {
+                case PRODUCE:
+                case RETURN:
+                    available_products->push_back(product);
+                    break;
+                case BUY:
+                case STEAL:
+                    if (available_products->empty() ||
+                        available_products->front().getId() != event.id) {
+                        corrupted = true;
+                        break;
+                    }
+                    available_products->pop_front();
+                    if (event.type == STEAL) {
+                        stolen_products->push_back(
+                                std::pair<Product, int>(product,
+                                                        event.fake_id));
+                    }
+                    break;
+                case RECALL: {
+                    auto recalled = std::find_if(
+                            available_products->begin(),
+                            available_products->end(),
+                            [&event](const Product &available) {
+                                return available.getId() == event.id;
+                            });
+                    if (recalled == available_products->end()) {
+                        corrupted = true;
+                        break;
+                    }
+                    available_products->erase(recalled);
+                    break;
+                }
+                case RECOVER: {
+                    auto recovered = std::find_if(
+                            stolen_products->begin(), stolen_products->end(),
+                            [&event](const std::pair<Product, int> &stolen) {
+                                return stolen.first.getId() == event.id &&
+                                       stolen.second == event.fake_id;
+                            });
+                    if (recovered == stolen_products->end()) {
+                        corrupted = true;
+                        break;
+                    }
+                    available_products->push_back(recovered->first);
+                    stolen_products->erase(recovered);
+                    break;
+                }
+                default:
+                    corrupted = true;
+            }
+            replayed++;
+        }
+        if (bytes % sizeof(Event) != 0) break;
+    }
+    close(in);
+    return corrupted ? -1 : replayed;
+}
@@ -0,0 +1,103 @@
+#ifndef EVENT_LOG_H_
+#define EVENT_LOG_H_
+
+#include <pthread.h>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <vector>
+#include "Product.h"
+
+/*
+ * Append-only binary log of the factory's product events.
+ * Events are put in a lock-free ring by the factory and written to the file
+ * by a background thread, several events per write() (group commit). How
+ * often the file is fsync'ed is set by the log's durability level.
+ */
+class EventLog {
+public:
+    enum EventType {
+        PRODUCE = 1,
+        BUY = 2,
+        RETURN = 3,
+        STEAL = 4,
+        RECALL = 5,
+        RECOVER = 6
+    };
+
+    enum Durability {
+        NO_SYNC,          // leave flushing to the OS
+        SYNC_PERIODIC,    // fsync at most once every sync_interval_ms
+        SYNC_EVERY_BATCH  // fsync after every group of written events
+    };
+
+    // the on-disk record, fake_id is only meaningful for STEAL and RECOVER
+    struct Event {
+        int32_t type;
+        int32_t id;
+        int32_t value;
+        int32_t fake_id;
+    };
+
+    /*
+     * Opens (appending to) the log at path and starts the writer thread.
+     * Throws std::runtime_error if the file can not be opened.
+     */
+    EventLog(const std::string &path, Durability durability,
+             unsigned int sync_interval_ms = 10);
+
+    ~EventLog();
+
+    EventLog(const EventLog &) = delete;
+
+    EventLog &operator=(const EventLog &) = delete;
+
+    // never blocks unless the ring is full
+    void append(EventType type, int id, int value, int fake_id = 0);
+
+    // waits until every event appended so far is written and fsync'ed
+    void flush();
+
+    /*
+     * Rebuilds the available and stolen products from the log at path.
+     * A RECALL removes the first available product with its id, a RECOVER
+     * moves the first product the thief stole with its id back to the
+     * available products, the others remove the oldest product.
+     * Returns the number of events replayed, or -1 if the log is corrupted.
+     */
+    static long replay(const std::string &path,
+                       std::list<Product> *available_products,
+                       std::list<std::pair<Product, int>> *stolen_products);
+
+private:
+    static const std::size_t RING_SIZE = 1 << 16;
+    static const std::size_t BATCH_SIZE = 4096;
+
+    struct Slot {
+        std::atomic<std::size_t> sequence;
+        Event event;
+    };
+
+    static void *writerFunc(void *arg);
+
+    void writerLoop();
+
+    // moves up to BATCH_SIZE events from the ring to batch
+    std::size_t drain(std::vector<Event> *batch);
+
+    void writeBatch(const std::vector<Event> &batch);
+
+    int fd;
+    Durability durability;
+    unsigned int sync_interval_ms;
+    Slot *ring;
+    std::atomic<std::size_t> enqueue_pos;
+    std::size_t dequeue_pos; // only used by the writer thread
+    std::atomic<std::size_t> written_count;
+    std::atomic<std::size_t> synced_count;
+    std::atomic<bool> stopping;
+    pthread_t writer_thread;
+};
+
+#endif // EVENT_LOG_H_
@@ -1,6 +1,132 @@
 #include "Factory.h"
+#include "FactoryRules.h"
+#include "ProductFile.h"
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <unordered_set>
 #include <vector>
 #include <iostream>
+#include <time.h>
+
+// who the current thread is, for recording and replaying schedules
+static thread_local char visitor_role = Schedule::MAIN;
+static thread_local unsigned int visitor_id = 0;
+
+// gives every factory a different Factory::serial
+static std::atomic<unsigned long> next_factory_serial(1);
+
+// the staging buffer this thread used last, and its factory's serial
+static thread_local unsigned long staging_serial = 0;
+static thread_local void *staging_cache = nullptr;
+
+// produceFromFile reads this many records per lock hold, 512 KiB
+static const std::size_t FILE_CHUNK_RECORDS = 1 << 16;
+// and asks the kernel for this many chunks ahead
+static const std::size_t FILE_READ_AHEAD_CHUNKS = 8;
+
+static long long monotonicNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// staging delays are in milliseconds, the coarse clock is precise enough
+static long long coarseNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+bool Factory::thievesInside() const {
+    return FactoryRules::thievesInside(RulesView(this));
+}
+
+bool Factory::returnsClosed() const {
+    return FactoryRules::returnsClosed(RulesView(this));
+}
+
+bool Factory::admitVisitor() {
+    lockFactory();
+    bool admitted = admitting;
+    if (admitted) active_visitors++;
+    unlockFactory();
+    return admitted;
+}
+
+void Factory::visitorLeft() {
+    lockFactory();
+    if (--active_visitors == 0) visitors_cond.broadcast();
+    unlockFactory();
+}
+
+std::size_t Factory::joinVisitors() {
+    std::size_t joined = 0;
+    std::map<unsigned int, pthread_t *> *threads[] = {
+            &production_threads, &simple_buyer_threads,
+            &company_buyer_threads, &thief_threads};
+    for (auto thread_map : threads) {
+        for (auto &thread : *thread_map) {
+            // producers return nothing, the other visitors a heap int
+            int *result = nullptr;
+            pthread_join(*thread.second, (void **) &result);
+            delete result;
+            delete thread.second;
+            joined++;
+        }
+        thread_map->clear();
+    }
+    return joined;
+}
+
+std::size_t Factory::drain() {
+    lockFactory();
+    admitting = false;
+    unlockFactory();
+    std::size_t joined = joinVisitors();
+    lockFactory();
+    // the company buyers that run in their callers' threads
+    while (active_visitors > 0) waitFactory(&visitors_cond);
+    unlockFactory();
+    publishStaged();
+    return joined;
+}
+
+ShutdownStatus Factory::shutdown(long timeout_ms) {
+    long long deadline_ns = monotonicNs() + timeout_ms * 1000000LL;
+    ShutdownStatus status;
+    lockFactory();
+    admitting = false;
+    while (active_visitors > 0 &&
+           waitFactoryUntil(&visitors_cond, deadline_ns)) {}
+    status.cancelled = active_visitors;
+    // also cuts the waits of threads that call the factory directly
+    cancelled = true;
+    wakeCompanies();
+    open_to_visitors_cond.broadcast();
+    open_to_returns_cond.broadcast();
+    space_cond.broadcast();
+    unlockFactory();
+    status.joined = joinVisitors();
+    publishStaged();
+    return status;
+}
+
+void Factory::createVisitorThread(pthread_t *thread, void *(*func)(void *),
+                                  void *arg) {
+    if (!topology) {
+        pthread_create(thread, nullptr, func, arg);
+        return;
+    }
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    cpu_set_t cpus;
+    topology->cpuSetOf(next_node, &cpus);
+    next_node = (next_node + 1) % topology->nodeCount();
+    pthread_attr_setaffinity_np(&attributes, sizeof(cpus), &cpus);
+    pthread_create(thread, &attributes, func, arg);
+    pthread_attr_destroy(&attributes);
+}
 
 void Factory::removeProductionThreadFromList(unsigned int id) {
     delete production_threads[id];
@@ -27,22 +153,36 @@ public:
     ProductionArgument(Factory *factory, int num_products, Product *products,
                        unsigned int id)
             : factory(factory), num_products(num_products),
-              products(products) {}
+              products(products), id(id) {}
 
     ~ProductionArgument() = default;
 
     Factory *factory;
     int num_products;
     Product *products;
+    unsigned int id;
+};
+
+class FileProductionArgument {
+public:
+    FileProductionArgument(Factory *factory, const std::string &path,
+                           unsigned int id)
+            : factory(factory), path(path), id(id) {}
+
+    Factory *factory;
+    std::string path;
+    unsigned int id;
 };
 
 class SimpleBuyerArgument {
 public:
-    SimpleBuyerArgument(Factory *factory, unsigned int id) : factory(factory) {}
+    SimpleBuyerArgument(Factory *factory, unsigned int id)
+            : factory(factory), id(id) {}
 
     ~SimpleBuyerArgument() = default;
 
     Factory *factory;
+    unsigned int id;
 };
 
 class CompanyArgument {
@@ -72,105 +212,648 @@ public:
     int num_products;
 };
 
-Factory::Factory() : open_to_returns(true), open_to_visitors(true),
-                     products_being_edited(false), thief_count(0),
-                     company_buyer_count(0) {
-    pthread_cond_init(&open_to_visitors_cond, nullptr);
-    pthread_cond_init(&open_to_returns_cond, nullptr);
-    //=================================================================
-    pthread_mutexattr_init(&products_lock_attributes);
-    pthread_mutexattr_settype(&products_lock_attributes,
-                              PTHREAD_MUTEX_ERRORCHECK);
-    pthread_mutex_init(&factory_lock, &products_lock_attributes);
-    pthread_cond_init(&products_cond, nullptr);
+Factory::Factory(FactoryLock::Policy lock_policy)
+        : open_to_visitors(true), schedule_active(false), thief_count(0),
+          company_buyer_count(0), available_count(0), staged_count(0),
+          staging_active(false), staging_batch(0), staging_delay_ns(0),
+          serial(next_factory_serial++), factory_lock(lock_policy),
+          open_to_returns(true), admitting(true), cancelled(false),
+          active_visitors(0), capacity(0), low_watermark(0),
+          space_waiters(0), peak_available(0), producer_waits(0),
+          admission_policy(GREEDY), admission_bound_ns(0),
+          reservations(false), reserving_orders(0), hand_off(true),
+          next_node(0) {}
+
+Factory::Factory(const std::string &store_path) : Factory() {
+    store.reset(new PersistentStore(store_path));
+    if (!store->attached()) return;
+    open_to_visitors = store->openToVisitors();
+    open_to_returns = store->openToReturns();
+    metrics.open_to_returns = open_to_returns;
+    auto available = store->availableBegin();
+    for (std::size_t i = 0; i < store->availableCount(); ++i) {
+        available_products.push_back(
+                Product(available[i].id, available[i].value));
+        product_index.insert(available[i].id,
+                             std::prev(available_products.end()));
+    }
+    available_count = available_products.size();
+    peak_available = available_products.size();
+    auto stolen = store->stolenBegin();
+    for (std::size_t i = 0; i < store->stolenCount(); ++i) {
+        if (store->stolenRecovered(i)) {
+            stolen_products.appendRecovered(stolen[i].id, stolen[i].value,
+                                            stolen[i].fake_id);
+        } else {
+            stolen_products.append(stolen[i].id, stolen[i].value,
+                                   stolen[i].fake_id);
+        }
+    }
 }
 
 Factory::~Factory() {
-    pthread_cond_destroy(&products_cond);
-    pthread_mutex_destroy(&factory_lock);
-    pthread_cond_destroy(&open_to_visitors_cond);
-    pthread_cond_destroy(&open_to_returns_cond);
+    if (!production_threads.empty() || !simple_buyer_threads.empty() ||
+        !company_buyer_threads.empty() || !thief_threads.empty()) {
+        shutdown(0);
+    }
+}
+
+void Factory::lockFactory() {
+    factory_lock.lock();
+    if (schedule) awaitTurn(Schedule::LOCK);
+}
+
+void Factory::unlockFactory() {
+    factory_lock.unlock();
+}
+
+void Factory::waitFactory(FactoryCond *cond) {
+    if (schedule && schedule->mode() == Schedule::REPLAY &&
+        !schedule->finished()) {
+        // the recorded schedule decides when this thread wakes up
+        awaitTurn(Schedule::WAKE);
+        return;
+    }
+    cond->wait(factory_lock);
+    if (schedule) awaitTurn(Schedule::WAKE);
+}
+
+bool Factory::waitFactoryUntil(FactoryCond *cond, long long deadline_ns) {
+    long long remaining_ns = deadline_ns - monotonicNs();
+    if (remaining_ns <= 0) return false;
+    if (schedule) {
+        // a schedule controls wakeups, so timeouts are not replayable
+        waitFactory(cond);
+        return true;
+    }
+    cond->waitFor(factory_lock, remaining_ns);
+    return true;
+}
+
+/*
+ * Called with factory_lock held. Records the event, or in replay mode waits
+ * until the event is the next one in the schedule.
+ */
+void Factory::awaitTurn(Schedule::EventKind kind) {
+    if (schedule->mode() == Schedule::RECORD) {
+        schedule->record(visitor_role, visitor_id, kind);
+        return;
+    }
+    while (schedule && !schedule->isTurn(visitor_role, visitor_id, kind)) {
+        schedule_cond.wait(factory_lock);
+    }
+    // the schedule may have been stopped while this thread waited
+    if (!schedule || schedule->finished()) return;
+    schedule->advance();
+    schedule_cond.broadcast();
+    if (schedule->finished()) {
+        // threads that skipped their real waits must check their conditions
+        wakeCompanies();
+        open_to_visitors_cond.broadcast();
+        open_to_returns_cond.broadcast();
+    }
+}
+
+void Factory::noteAdded(const Product &product, EventLog::EventType reason) {
+    if (reason == EventLog::RETURN) {
+        metrics.returned.fetch_add(1, std::memory_order_relaxed);
+    } else if (reason == EventLog::RECOVER) {
+        metrics.recovered.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        metrics.produced.fetch_add(1, std::memory_order_relaxed);
+    }
+    // recoveries are logged by noteRecovered, which knows the thief
+    if (event_log && reason != EventLog::RECOVER) {
+        event_log->append(reason, product.getId(), product.getValue());
+    }
+    if (store) {
+        store->pushAvailable(product.getId(), product.getValue());
+    }
+}
+
+void Factory::noteRemoved(const Product &product,
+                          EventLog::EventType reason) {
+    if (reason == EventLog::BUY) {
+        metrics.bought.fetch_add(1, std::memory_order_relaxed);
+    }
+    // thefts are logged by recordStolen, which knows the thief
+    if (event_log && reason != EventLog::STEAL) {
+        event_log->append(reason, product.getId(), product.getValue());
+    }
+    if (store) store->popAvailable();
+}
+
+void Factory::countAvailable() {
+    available_count.store(available_products.size(), std::memory_order_release);
+    if (available_products.size() > peak_available) {
+        peak_available = available_products.size();
+    }
+}
+
+void Factory::pushAvailable(const Product &product,
+                            EventLog::EventType reason) {
+    available_products.push_back(product);
+    product_index.insert(product.getId(),
+                         std::prev(available_products.end()));
+    countAvailable();
+    noteAdded(product, reason);
+}
+
+void Factory::appendAvailable(std::list<Product> *products,
+                              EventLog::EventType reason) {
+    // the iterators stay valid when the nodes are spliced
+    for (auto i = products->begin(); i != products->end(); ++i) {
+        product_index.insert(i->getId(), i);
+        noteAdded(*i, reason);
+    }
+    available_products.splice(available_products.end(), *products);
+    countAvailable();
+}
+
+Product Factory::popAvailable(EventLog::EventType reason) {
+    product_index.erase(available_products.front().getId(),
+                        available_products.begin());
+    Product product = std::move(available_products.front());
+    available_products.pop_front();
+    countAvailable();
+    noteRemoved(product, reason);
+    return product;
+}
+
+void Factory::takeAvailable(std::size_t num_products, std::list<Product> *out,
+                            EventLog::EventType reason) {
+    auto end = available_products.begin();
+    for (std::size_t i = 0; i < num_products; ++i, ++end) {
+        product_index.erase(end->getId(), end);
+        noteRemoved(*end, reason);
+    }
+    out->splice(out->end(), available_products, available_products.begin(),
+                end);
+    countAvailable();
+}
+
+void Factory::recordStolen(const Product &product, int fake_id) {
+    int id = product.getId();
+    int value = product.getValue();
+    stolen_products.append(id, value, fake_id);
+    metrics.stolen.fetch_add(1, std::memory_order_relaxed);
+    if (event_log) event_log->append(EventLog::STEAL, id, value, fake_id);
+    if (store) store->appendStolen(id, value, fake_id);
 }
 
 void *productionFunc(void *arg) {
+    visitor_role = Schedule::PRODUCER;
+    visitor_id = static_cast<ProductionArgument *>(arg)->id;
     auto factory = static_cast<ProductionArgument *>(arg)->factory;
     auto num_products = static_cast<ProductionArgument *>(arg)->num_products;
     auto products = static_cast<ProductionArgument *>(arg)->products;
     factory->Factory::produce(num_products, products);
+    factory->dropStagingBuffer();
     delete static_cast<ProductionArgument *>(arg);
+    factory->visitorLeft();
     return nullptr;
 }
 
+void *fileProductionFunc(void *arg) {
+    visitor_role = Schedule::PRODUCER;
+    visitor_id = static_cast<FileProductionArgument *>(arg)->id;
+    auto factory = static_cast<FileProductionArgument *>(arg)->factory;
+    factory->produceFromFile(static_cast<FileProductionArgument *>(arg)->path);
+    delete static_cast<FileProductionArgument *>(arg);
+    factory->visitorLeft();
+    return nullptr;
+}
+
+void Factory::startFileProduction(const std::string &path, unsigned int id) {
+    if (!admitVisitor()) return;
+    production_threads[id] = new pthread_t;
+    auto arg = new FileProductionArgument(this, path, id);
+    createVisitorThread(production_threads[id], fileProductionFunc, arg);
+}
+
+long Factory::produceFromFile(const std::string &path) {
+    std::unique_ptr<ProductFile> file;
+    try {
+        file.reset(new ProductFile(path));
+    } catch (const std::runtime_error &) {
+        return -1;
+    }
+    const ProductFile::Record *records = file->records();
+    long produced = 0;
+    bool stopped = false;
+    file->willNeed(0, FILE_CHUNK_RECORDS * FILE_READ_AHEAD_CHUNKS);
+    for (std::size_t begin = 0; begin < file->size() && !stopped;
+         begin += FILE_CHUNK_RECORDS) {
+        std::size_t end = std::min(begin + FILE_CHUNK_RECORDS, file->size());
+        file->willNeed(begin + FILE_CHUNK_RECORDS * FILE_READ_AHEAD_CHUNKS,
+                       end + FILE_CHUNK_RECORDS * FILE_READ_AHEAD_CHUNKS);
+        // the nodes are built from the mapping outside of the lock
+        std::list<Product> chunk;
+        for (std::size_t i = begin; i < end; ++i) {
+            chunk.emplace_back(records[i].id, records[i].value);
+        }
+        lockFactory();
+        produced += insertList(&chunk);
+        // like produce, only a shutdown stops the wait
+        while (!chunk.empty() && !stopped) {
+            if (waitForSpace(0)) {
+                produced += insertList(&chunk);
+            } else {
+                stopped = true;
+            }
+        }
+        unlockFactory();
+        file->done(begin, end);
+    }
+    return produced;
+}
+
 void Factory::startProduction(int num_products, Product *products,
                               unsigned int id) {
+    if (!admitVisitor()) return;
     production_threads[id] = new pthread_t;
     auto arg = new ProductionArgument(this, num_products, products, id);
-    pthread_create(production_threads[id], nullptr, productionFunc, arg);
+    createVisitorThread(production_threads[id], productionFunc, arg);
 }
 
-void Factory::produce(int num_products, Product *products) {
-//    std::cout << "Production " << pthread_self() << " LOCKING STARTED" <<
-//              std::endl;
-    pthread_mutex_lock(&factory_lock);
-    while (products_being_edited) {
-//        std::cout << "Production " << pthread_self() << " WAITING PRODUCTS" <<
-//                  std::endl;
-        pthread_cond_wait(&products_cond, &factory_lock);
-        pthread_mutex_lock(&factory_lock);
-    }
-    products_being_edited = true;
+template<class Deliver>
+std::size_t Factory::handOff(std::size_t incoming, Deliver deliver) {
+    // reserving orders come first, and fillOrders serves them from the
+    // inventory
+    if (!hand_off || company_orders.empty() || reserving_orders > 0 ||
+        FactoryRules::companiesBlocked(RulesView(this))) {
+        return 0;
+    }
+    std::size_t handed = 0;
+    long long now_ns = monotonicNs();
+    auto order = company_orders.begin();
+    while (order != company_orders.end() && handed < incoming) {
+        long long recheck_ns;
+        if (!FactoryRules::mayBuy(admission_policy, admission_bound_ns, now_ns,
+                                  available_products.size() + incoming -
+                                  handed, company_orders.begin(), order,
+                                  &recheck_ns)) {
+            // the orders that are not allowed now stay so as the products
+            // run out, and letting this one go does not unblock them
+            ++order;
+            continue;
+        }
+        // what buying right after the products were added would take: the
+        // available products, then the oldest new ones, so the event log and
+        // the store see every new product added and then bought
+        std::size_t from_stock = std::min(
+                static_cast<std::size_t>(order->num_products),
+                available_products.size());
+        takeAvailable(from_stock, &order->claimed, EventLog::BUY);
+        std::size_t fresh = order->num_products - from_stock;
+        deliver(handed, fresh, &order->claimed);
+        auto first = std::prev(order->claimed.end(), fresh);
+        for (auto i = first; i != order->claimed.end(); ++i) {
+            noteAdded(*i, EventLog::PRODUCE);
+        }
+        for (auto i = first; i != order->claimed.end(); ++i) {
+            noteRemoved(*i, EventLog::BUY);
+        }
+        metrics.handed_off.fetch_add(fresh, std::memory_order_relaxed);
+        handed += fresh;
+        auto next = std::next(order);
+        order->handed = true;
+        handed_orders.splice(handed_orders.end(), company_orders, order);
+        order->ready.broadcast();
+        order = next;
+    }
+    if (handed > 0) releaseSpace();
+    return handed;
+}
+
+int Factory::insertProducts(int num_products, Product *products) {
+    int handed = static_cast<int>(handOff(
+            num_products, [products](std::size_t first, std::size_t count,
+                                     std::list<Product> *out) {
+                out->insert(out->end(), products + first,
+                            products + first + count);
+            }));
+    int inserted = num_products - handed;
+    if (capacity > 0) {
+        std::size_t space = available_products.size() < capacity ?
+                            capacity - available_products.size() : 0;
+        if (space < static_cast<std::size_t>(inserted)) {
+            inserted = static_cast<int>(space);
+        }
+    }
+    for (int i = handed; i < handed + inserted; ++i) {
+        pushAvailable(products[i], EventLog::PRODUCE);
+    }
+    if (inserted > 0) productsAdded();
+    return handed + inserted;
+}
+
+// moves the first count nodes of products to the end of out
+static void spliceFront(std::list<Product> *products, std::size_t count,
+                        std::list<Product> *out) {
+    out->splice(out->end(), *products, products->begin(),
+                std::next(products->begin(), count));
+}
+
+std::size_t Factory::insertList(std::list<Product> *products) {
+    // the handed products leave products from the front
+    std::size_t handed = handOff(
+            products->size(), [products](std::size_t, std::size_t count,
+                                         std::list<Product> *out) {
+                spliceFront(products, count, out);
+            });
+    std::size_t inserted = products->size();
+    if (capacity > 0) {
+        std::size_t space = available_products.size() < capacity ?
+                            capacity - available_products.size() : 0;
+        inserted = std::min(inserted, space);
+    }
+    if (inserted == 0) return handed;
+    if (inserted == products->size()) {
+        appendAvailable(products, EventLog::PRODUCE);
+    } else {
+        std::list<Product> part;
+        spliceFront(products, inserted, &part);
+        appendAvailable(&part, EventLog::PRODUCE);
+    }
+    productsAdded();
+    return handed + inserted;
+}
+
+void Factory::productsAdded() {
+    // reserving orders are woken by fillOrders once they are complete
+    if (company_orders.size() > reserving_orders) wakeCompanies();
+    fillOrders();
+}
+
+void Factory::wakeCompanies() {
+    products_cond.broadcast();
+    for (auto &order : company_orders) {
+        if (!order.reserving) order.ready.broadcast();
+    }
+}
+
+Factory::StagingBuffer *Factory::stagingBuffer() {
+    if (staging_serial == serial) {
+        return static_cast<StagingBuffer *>(staging_cache);
+    }
+    lockFactory();
+    auto &buffer = staging_buffers[pthread_self()];
+    if (!buffer) buffer.reset(new StagingBuffer());
+    unlockFactory();
+    staging_serial = serial;
+    staging_cache = buffer.get();
+    return buffer.get();
+}
+
+void Factory::dropStagingBuffer() {
+    // the thread only staged for this factory if its cache points here
+    if (staging_serial != serial) return;
+    lockFactory();
+    auto buffer = staging_buffers.find(pthread_self());
+    if (buffer != staging_buffers.end()) {
+        publishBuffer(buffer->second.get());
+        staging_buffers.erase(buffer);
+    }
+    unlockFactory();
+    staging_serial = 0;
+    staging_cache = nullptr;
+}
+
+void Factory::stageProducts(int num_products, Product *products) {
+    StagingBuffer *buffer = stagingBuffer();
+    long long now = coarseNs();
+    buffer->lock.lock();
+    if (buffer->products.empty()) buffer->oldest_ns = now;
     for (int i = 0; i < num_products; ++i) {
-        available_products.push_back(products[i]);
+        buffer->products.push_back(products[i]);
     }
-    products_being_edited = false;
-    pthread_cond_signal(&products_cond);
-//    std::cout << "Production " << pthread_self() << " UNLOCKING DONE" <<
-//              std::endl;
-    pthread_mutex_unlock(&factory_lock);
+    staged_count.fetch_add(num_products, std::memory_order_release);
+    // staging may have been turned off, and its buffers flushed, since
+    // produce checked it
+    bool publish =
+            !staging_active.load(std::memory_order_acquire) ||
+            buffer->products.size() >= staging_batch.load() ||
+            now - buffer->oldest_ns >= staging_delay_ns.load() ||
+            company_buyer_count.load(std::memory_order_acquire) > 0;
+    buffer->lock.unlock();
+    if (publish) {
+        lockFactory();
+        publishBuffer(buffer);
+        unlockFactory();
+    }
+}
+
+void Factory::publishBuffer(StagingBuffer *buffer) {
+    std::list<Product> published;
+    buffer->lock.lock();
+    published.swap(buffer->products);
+    staged_count.fetch_sub(published.size(), std::memory_order_release);
+    buffer->lock.unlock();
+    if (published.empty()) return;
+    handOff(published.size(), [&published](std::size_t, std::size_t count,
+                                           std::list<Product> *out) {
+        spliceFront(&published, count, out);
+    });
+    if (published.empty()) return;
+    appendAvailable(&published, EventLog::PRODUCE);
+    productsAdded();
+}
+
+void Factory::publishAllStaged() {
+    for (auto &buffer : staging_buffers) publishBuffer(buffer.second.get());
+}
+
+void Factory::publishExpired() {
+    if (staged_count.load(std::memory_order_acquire) == 0) return;
+    long long now = coarseNs();
+    for (auto &entry : staging_buffers) {
+        StagingBuffer *buffer = entry.second.get();
+        buffer->lock.lock();
+        bool expired = !buffer->products.empty() &&
+                       now - buffer->oldest_ns >= staging_delay_ns.load();
+        buffer->lock.unlock();
+        if (expired) publishBuffer(buffer);
+    }
+}
+
+void Factory::updateStaging() {
+    staging_active = staging_batch > 0 && capacity == 0 && !schedule;
+    if (!staging_active) publishAllStaged();
+}
 
+void Factory::publishStaged() {
+    lockFactory();
+    publishAllStaged();
+    unlockFactory();
+}
+
+void Factory::setStaging(std::size_t batch_size, long max_delay_ms) {
+    lockFactory();
+    staging_batch = batch_size;
+    staging_delay_ns = max_delay_ms * 1000000LL;
+    updateStaging();
+    unlockFactory();
+}
+
+bool Factory::waitForSpace(long long deadline_ns) {
+    long long start_ns = monotonicNs();
+    space_waiters++;
+    producer_waits++;
+    // the waiting counts change under the lock, so outside of it they only
+    // count threads that are really waiting
+    metrics.producers_waiting++;
+    bool in_time = true;
+    while (FactoryRules::producersBlocked(RulesView(this)) && in_time &&
+           !cancelled) {
+        if (deadline_ns == 0) {
+            waitFactory(&space_cond);
+        } else {
+            in_time = waitFactoryUntil(&space_cond, deadline_ns);
+        }
+    }
+    space_waiters--;
+    metrics.producers_waiting--;
+    metrics.producer_wait.record(monotonicNs() - start_ns);
+    return in_time && !cancelled;
+}
+
+void Factory::releaseSpace() {
+    if (space_waiters > 0 && available_products.size() <= low_watermark) {
+        space_cond.broadcast();
+    }
+}
+
+void Factory::produce(int num_products, Product *products) {
+    if (staging_active.load(std::memory_order_acquire)) {
+        stageProducts(num_products, products);
+        return;
+    }
+    lockFactory();
+    int produced = insertProducts(num_products, products);
+    // only a shutdown stops the wait, the other products are dropped
+    while (produced < num_products && waitForSpace(0)) {
+        produced += insertProducts(num_products - produced,
+                                   products + produced);
+    }
+    unlockFactory();
+}
+
+bool Factory::tryProduce(int num_products, Product *products) {
+    lockFactory();
+    bool fits = capacity == 0 ||
+                available_products.size() + num_products <= capacity;
+    if (fits) insertProducts(num_products, products);
+    unlockFactory();
+    return fits;
+}
+
+int Factory::produceFor(int num_products, Product *products, long timeout_ms) {
+    long long deadline_ns = monotonicNs() + timeout_ms * 1000000LL;
+    lockFactory();
+    int produced = insertProducts(num_products, products);
+    while (produced < num_products && waitForSpace(deadline_ns)) {
+        produced += insertProducts(num_products - produced,
+                                   products + produced);
+    }
+    unlockFactory();
+    return produced;
+}
+
+void Factory::setCapacity(std::size_t capacity, std::size_t low_watermark) {
+    lockFactory();
+    this->capacity = capacity;
+    this->low_watermark = capacity > 0 && (low_watermark == 0 ||
+                                           low_watermark >= capacity) ?
+                          capacity - 1 : low_watermark;
+    // staged products would bypass the limit
+    updateStaging();
+    // the limit may have grown
+    space_cond.broadcast();
+    unlockFactory();
 }
 
 void Factory::finishProduction(unsigned int id) {
+    // not admitted, or already joined by drain or shutdown
+    if (production_threads.count(id) == 0) return;
     void **result = nullptr;
     pthread_join(*production_threads[id], result);
     removeProductionThreadFromList(id);
 }
 
 void *simpleBuyerFunc(void *arg) {
-    auto factory = static_cast<ProductionArgument *>(arg)->factory;
+    visitor_role = Schedule::SIMPLE_BUYER;
+    visitor_id = static_cast<SimpleBuyerArgument *>(arg)->id;
+    auto factory = static_cast<SimpleBuyerArgument *>(arg)->factory;
     auto bought_value_ptr = new int(factory->tryBuyOne());
     delete static_cast<SimpleBuyerArgument *>(arg);
+    factory->visitorLeft();
     return bought_value_ptr;
 }
 
 void Factory::startSimpleBuyer(unsigned int id) {
+    if (!admitVisitor()) return;
     simple_buyer_threads[id] = new pthread_t;
     auto arg = new SimpleBuyerArgument(this, id);
-    pthread_create(simple_buyer_threads[id], nullptr, simpleBuyerFunc, arg);
+    createVisitorThread(simple_buyer_threads[id], simpleBuyerFunc, arg);
+}
+
+bool Factory::simpleBuyersBlocked() {
+    // the rule reads available_count last, its line changes often
+    return FactoryRules::simpleBuyersBlocked(RulesView(this));
 }
 
 int Factory::tryBuyOne() {
-//    std::cout << "Simple " << pthread_self() << " LOCKING STARTED" << std::endl;
-    pthread_mutex_lock(&factory_lock);
-    while (!open_to_visitors || products_being_edited ||
-           available_products.empty() || thief_count > 0 ||
-           company_buyer_count > 0) {
-//        std::cout << "Simple " << pthread_self() << " UNLOCKING" << std::endl;
-        pthread_cond_signal(&products_cond);
-        pthread_mutex_unlock(&factory_lock);
+    // a replayed schedule decides what probes see, so they must lock
+    if (!schedule_active.load(std::memory_order_acquire) &&
+        simpleBuyersBlocked() &&
+        staged_count.load(std::memory_order_acquire) == 0) {
         return -1;
     }
-    products_being_edited = true;
-    int id = available_products.front().getId();
-    available_products.pop_front();
-    products_being_edited = false;
-    pthread_cond_signal(&products_cond);
-//    std::cout << "Simple " << pthread_self() << " UNLOCKING" << std::endl;
-    pthread_mutex_unlock(&factory_lock);
+    lockFactory();
+    // a starved buyer pulls the products that were not published yet
+    if (available_products.empty() && staged_count.load() > 0) {
+        publishAllStaged();
+    } else {
+        publishExpired();
+    }
+    if (simpleBuyersBlocked()) {
+        unlockFactory();
+        return -1;
+    }
+    int id = popAvailable(EventLog::BUY).getId();
+    releaseSpace();
+    unlockFactory();
     return id;
 }
 
+int Factory::tryBuyMany(int num_buyers, int *results) {
+    int bought = 0;
+    bool blocked = !schedule_active.load(std::memory_order_acquire) &&
+                   simpleBuyersBlocked() &&
+                   staged_count.load(std::memory_order_acquire) == 0;
+    if (!blocked) {
+        lockFactory();
+        if (available_products.empty() && staged_count.load() > 0) {
+            publishAllStaged();
+        } else {
+            publishExpired();
+        }
+        // nothing a simple buyer checks can change inside the section
+        if (!simpleBuyersBlocked()) {
+            while (bought < num_buyers && !available_products.empty()) {
+                results[bought++] = popAvailable(EventLog::BUY).getId();
+            }
+            releaseSpace();
+        }
+        unlockFactory();
+    }
+    for (int i = bought; i < num_buyers; ++i) results[i] = -1;
+    return bought;
+}
+
 int Factory::finishSimpleBuyer(unsigned int id) {
+    if (simple_buyer_threads.count(id) == 0) return -1;
     int *bought_id_ptr;
     int bought_id;
     pthread_join(*simple_buyer_threads[id], (void **) &bought_id_ptr);
@@ -189,7 +872,9 @@ int filterProducts(std::list<Product> *bought_products, int min_value) {
     int num_to_return = 0;
     auto i = bought_products->begin();
     while (i != bought_products->end()) {
-        if (i->getValue() >= min_value) i = bought_products->erase(i);
+        if (i->getValue() >= min_value) {
+            i = bought_products->erase(i);
+        }
         else {
             ++i;
             num_to_return++;
@@ -199,128 +884,384 @@ int filterProducts(std::list<Product> *bought_products, int min_value) {
 }
 
 void *companyBuyerFunc(void *arg) {
+    visitor_role = Schedule::COMPANY_BUYER;
+    visitor_id = static_cast<CompanyArgument *>(arg)->id;
     auto factory = static_cast<CompanyArgument *>(arg)->factory;
     auto num_products = static_cast<CompanyArgument *>(arg)->num_products;
     auto min_value = static_cast<CompanyArgument *>(arg)->min_value;
     auto id = static_cast<CompanyArgument *>(arg)->id;
-    auto bought_products = factory->buyProducts(num_products);
     auto num_to_return_ptr = new int(
-            filterProducts(&bought_products, min_value));
-    if (*num_to_return_ptr > 0) factory->returnProducts(bought_products, id);
+            factory->companyVisit(num_products, min_value, id));
     delete static_cast<CompanyArgument *>(arg);
+    factory->visitorLeft();
     return num_to_return_ptr;
 }
 
+int Factory::companyVisit(int num_products, int min_value, unsigned int id) {
+    auto bought_products = buyProducts(num_products);
+    int num_to_return = filterProducts(&bought_products, min_value);
+    if (num_to_return > 0) {
+        // returnProducts lets the company out once the products are back
+        returnProducts(std::move(bought_products), id);
+    } else {
+        lockFactory();
+        company_buyer_count--;
+        unlockFactory();
+    }
+    return num_to_return;
+}
+
+int Factory::runCompanyBuyer(int num_products, int min_value,
+                             unsigned int id) {
+    if (!admitVisitor()) return 0;
+    lockFactory();
+    company_buyer_count++;
+    unlockFactory();
+    int num_to_return = companyVisit(num_products, min_value, id);
+    visitorLeft();
+    return num_to_return;
+}
+
 void Factory::startCompanyBuyer(int num_products, int min_value,
                                 unsigned int id) {
-    pthread_mutex_lock(&factory_lock);
+    if (!admitVisitor()) return;
+    lockFactory();
     company_buyer_count++;
-    pthread_mutex_unlock(&factory_lock);
+    unlockFactory();
     company_buyer_threads[id] = new pthread_t;
     auto arg = new CompanyArgument(this, num_products, min_value, id);
-    pthread_create(company_buyer_threads[id], nullptr, companyBuyerFunc, arg);
+    createVisitorThread(company_buyer_threads[id], companyBuyerFunc, arg);
+}
+
+const char *Factory::admissionPolicyName(AdmissionPolicy policy) {
+    switch (policy) {
+        case GREEDY:
+            return "greedy";
+        case FIFO:
+            return "fifo";
+        case AGING:
+            return "aging";
+        case MAX_WAIT:
+            return "max-wait";
+    }
+    return "unknown";
+}
+
+void Factory::setReservations(bool enabled) {
+    lockFactory();
+    reservations = enabled;
+    unlockFactory();
+}
+
+void Factory::fillOrders() {
+    if (FactoryRules::companiesBlocked(RulesView(this))) return;
+    bool completed = false;
+    for (auto &order : company_orders) {
+        if (available_products.empty()) break;
+        if (!order.reserving) continue;
+        std::size_t missing = order.num_products - order.claimed.size();
+        if (missing == 0) continue;
+        std::size_t claimed = std::min(missing, available_products.size());
+        takeAvailable(claimed, &order.claimed, EventLog::BUY);
+        if (claimed == missing) completed = true;
+    }
+    if (completed) products_cond.broadcast();
+    releaseSpace();
+}
+
+void Factory::setAdmissionPolicy(AdmissionPolicy policy, long bound_ms) {
+    lockFactory();
+    admission_policy = policy;
+    admission_bound_ns = bound_ms > 0 ? bound_ms * 1000000LL : 1;
+    // orders that were held back may be allowed now
+    wakeCompanies();
+    unlockFactory();
+}
+
+void Factory::setHandOff(bool enabled) {
+    lockFactory();
+    hand_off = enabled;
+    unlockFactory();
+}
+
+bool Factory::mayBuy(std::list<CompanyOrder>::iterator order,
+                     long long *recheck_ns) {
+    return FactoryRules::mayBuy(admission_policy, admission_bound_ns,
+                                monotonicNs(), available_products.size(),
+                                company_orders.begin(), order, recheck_ns);
+}
+
+void Factory::orderLeft(long long arrival_ns) {
+    metrics.companies_waiting--;
+    metrics.company_wait.record(monotonicNs() - arrival_ns);
 }
 
 std::list<Product> Factory::buyProducts(int num_products) {
     auto bought_products = std::list<Product>();
-//    std::cout << "Company Buying " << pthread_self() << " LOCKING" << std::endl;
-    pthread_mutex_lock(&factory_lock);
-    while (!open_to_visitors || thief_count > 0 || products_being_edited ||
-           available_products.size() < num_products) {
+    lockFactory();
+    publishExpired();
+    // the order's condition can not be copied, so it is built in place
+    auto order = company_orders.emplace(company_orders.end());
+    order->num_products = num_products;
+    order->arrival_ns = monotonicNs();
+    order->reserving = reservations;
+    long long arrival_ns = order->arrival_ns;
+    metrics.companies_waiting++;
+    if (order->reserving) {
+        reserving_orders++;
+        fillOrders();
+        bool complete = true;
+        while (FactoryRules::companiesBlocked(RulesView(this)) ||
+               order->claimed.size() <
+               static_cast<std::size_t>(num_products)) {
+            if (cancelled) {
+                complete = false;
+                break;
+            }
+            if (!FactoryRules::companiesBlocked(RulesView(this)) &&
+                staged_count > 0) {
+                // claims the staged products too
+                publishAllStaged();
+                continue;
+            }
+            if (!open_to_visitors) {
+                waitFactory(&open_to_visitors_cond);
+            } else {
+                // woken when an order is complete or the last thief leaves
+                waitFactory(&products_cond);
+            }
+        }
+        std::list<Product> claimed;
+        claimed.splice(claimed.end(), order->claimed);
+        company_orders.erase(order);
+        reserving_orders--;
+        orderLeft(arrival_ns);
+        if (complete) {
+            bought_products.splice(bought_products.end(), claimed);
+        } else {
+            // the claimed products go back, the company gets nothing
+            appendAvailable(&claimed, EventLog::RETURN);
+            productsAdded();
+            releaseSpace();
+        }
+        // an order behind this one may be allowed to buy now
+        if (admission_policy != GREEDY && !company_orders.empty()) {
+            wakeCompanies();
+        }
+        unlockFactory();
+        return bought_products;
+    }
+    long long recheck_ns = 0;
+    while (!order->handed &&
+           (FactoryRules::companiesBlocked(RulesView(this)) ||
+            !mayBuy(order, &recheck_ns))) {
+        if (cancelled) {
+            company_orders.erase(order);
+            orderLeft(arrival_ns);
+            unlockFactory();
+            return bought_products;
+        }
+        if (!FactoryRules::companiesBlocked(RulesView(this)) &&
+            staged_count > 0) {
+            publishAllStaged();
+            continue;
+        }
         if (!open_to_visitors) {
-//            std::cout << "Company Buying " << pthread_self() << " WAITING "
-//                                                                " VISITORS" <<
-//                      std::endl;
-            pthread_cond_wait(&open_to_visitors_cond, &factory_lock);
+            waitFactory(&open_to_visitors_cond);
+        } else if (!thievesInside() && recheck_ns != 0) {
+            waitFactoryUntil(&order->ready, recheck_ns);
         } else {
-            if (thief_count > 0) {
-//                std::cout << "Company Buying " << pthread_self() << " WAITING"
-//                                                                    " FOR "
-//                                                                    "THEIVES" <<
-//                           std::endl;
-            } else if (available_products.size() < num_products) {
-//                std::cout << "Company Buying " << pthread_self() << " "
-//                                                                   "WAITING "
-//                                                                   "NOT "
-//                                                                   "ENOUGH "
-//                                                                   "PRODUCTS"
-//                                                                   "" <<
-//                          std::endl;
-            }
-//            else std::cout << "Company Buying " << pthread_self() << " "
-//                                                                    "WAITING "
-//                                                                    "PRODUCTS"
-//                                                                    "" <<
-//                        std::endl;
-            pthread_cond_wait(&products_cond, &factory_lock);
+            // woken when products are added or handed to this order, a
+            // company leaves the queue or the last thief leaves
+            waitFactory(&order->ready);
         }
-//        std::cout << "Company Buying " << pthread_self() << " LOCKING" <<
-//                  std::endl;
-        pthread_mutex_lock(&factory_lock);
     }
-    products_being_edited = true;
-    for (int i = 0; i < num_products; ++i) {
-        bought_products.push_back(available_products.front());
-        available_products.pop_front();
+    if (order->handed) {
+        // a producer already bought the products for this order
+        bought_products.splice(bought_products.end(), order->claimed);
+        handed_orders.erase(order);
+        orderLeft(arrival_ns);
+        unlockFactory();
+        return bought_products;
     }
-    products_being_edited = false;
-    pthread_cond_broadcast(&products_cond);
-//    std::cout << "Company Buying " << pthread_self() << " UNLOCKING DONE" <<
-//              std::endl;
-    pthread_mutex_unlock(&factory_lock);
+    takeAvailable(num_products, &bought_products, EventLog::BUY);
+    company_orders.erase(order);
+    orderLeft(arrival_ns);
+    // the next order in line may be allowed to buy now
+    if (admission_policy != GREEDY && !company_orders.empty()) {
+        wakeCompanies();
+    }
+    releaseSpace();
+    unlockFactory();
     return bought_products;
 }
 
+std::size_t Factory::availableCount() const {
+    return available_count.load(std::memory_order_acquire);
+}
+
+std::list<Product> Factory::takeProducts(int max_products) {
+    std::list<Product> taken;
+    lockFactory();
+    if (!FactoryRules::simpleBuyersBlocked(RulesView(this))) {
+        std::size_t num_products = std::min(
+                static_cast<std::size_t>(std::max(max_products, 0)),
+                available_products.size());
+        takeAvailable(num_products, &taken, EventLog::BUY);
+        releaseSpace();
+    }
+    unlockFactory();
+    return taken;
+}
+
+std::size_t Factory::moveProductsTo(Factory &to, int max_products) {
+    if (&to == this) return 0;
+    // always in the same order, so two opposite moves can not deadlock
+    Factory *first = this < &to ? this : &to;
+    Factory *second = this < &to ? &to : this;
+    first->lockFactory();
+    second->lockFactory();
+    std::size_t num_products = 0;
+    if (!FactoryRules::simpleBuyersBlocked(RulesView(this))) {
+        num_products = std::min(
+                static_cast<std::size_t>(std::max(max_products, 0)),
+                available_products.size());
+        if (to.capacity > 0) {
+            std::size_t space = to.available_products.size() < to.capacity ?
+                                to.capacity - to.available_products.size() :
+                                0;
+            num_products = std::min(num_products, space);
+        }
+    }
+    if (num_products > 0) {
+        std::list<Product> moved;
+        takeAvailable(num_products, &moved, EventLog::BUY);
+        releaseSpace();
+        to.insertList(&moved);
+    }
+    second->unlockFactory();
+    first->unlockFactory();
+    return num_products;
+}
+
+RecallReport Factory::recallProducts(const std::vector<int> &ids) {
+    RecallReport report;
+    std::unordered_set<int> recalled_ids;
+    std::unordered_set<int> missing_ids;
+    lockFactory();
+    publishAllStaged();
+    for (int id : ids) {
+        if (recalled_ids.count(id) != 0 || missing_ids.count(id) != 0) {
+            continue;
+        }
+        ProductIndex::Position position;
+        if (!product_index.find(id, &position)) {
+            missing_ids.insert(id);
+            continue;
+        }
+        recalled_ids.insert(id);
+        do {
+            product_index.erase(id, position);
+            if (event_log) {
+                event_log->append(EventLog::RECALL, id,
+                                  position->getValue());
+            }
+            report.recalled.splice(report.recalled.end(), available_products,
+                                   position);
+            metrics.recalled.fetch_add(1, std::memory_order_relaxed);
+        } while (product_index.find(id, &position));
+    }
+    if (!recalled_ids.empty()) {
+        if (store) store->removeAvailable(recalled_ids);
+        countAvailable();
+        releaseSpace();
+    }
+    if (!missing_ids.empty()) {
+        std::unordered_set<int> stolen_ids;
+        stolen_products.forEach([&](int id, int, int) {
+            if (missing_ids.count(id) != 0) stolen_ids.insert(id);
+        });
+        for (int id : ids) {
+            if (missing_ids.erase(id) == 0) continue;
+            if (stolen_ids.count(id) != 0) {
+                report.stolen.push_back(id);
+            } else {
+                report.sold.push_back(id);
+            }
+        }
+    }
+    unlockFactory();
+    return report;
+}
+
+void Factory::noteRecovered(std::size_t row, int id, int value, int fake_id,
+                            std::list<Product> *recovered) {
+    recovered->push_back(Product(id, value));
+    if (event_log) {
+        event_log->append(EventLog::RECOVER, id, value, fake_id);
+    }
+    if (store) store->markRecovered(row);
+}
+
+std::size_t Factory::recoverStolen(unsigned int fake_id) {
+    std::list<Product> recovered;
+    lockFactory();
+    int thief = static_cast<int>(fake_id);
+    std::size_t num_recovered = stolen_products.recover(
+            thief, [&](std::size_t row, int id, int value) {
+                noteRecovered(row, id, value, thief, &recovered);
+            });
+    if (num_recovered > 0) {
+        appendAvailable(&recovered, EventLog::RECOVER);
+        productsAdded();
+    }
+    unlockFactory();
+    return num_recovered;
+}
+
+std::size_t Factory::recoverAllStolen() {
+    std::list<Product> recovered;
+    lockFactory();
+    std::size_t num_recovered = stolen_products.recoverAll(
+            [&](std::size_t row, int id, int value, int fake_id) {
+                noteRecovered(row, id, value, fake_id, &recovered);
+            });
+    if (num_recovered > 0) {
+        appendAvailable(&recovered, EventLog::RECOVER);
+        productsAdded();
+    }
+    unlockFactory();
+    return num_recovered;
+}
+
 void Factory::returnProducts(std::list<Product> products, unsigned int id) {
-//    std::cout << "Company Returning  " << pthread_self() << " LOCKING "
-//                                                            "START" <<
-//              std::endl;
-    pthread_mutex_lock(&factory_lock);
-    while (!open_to_visitors || !open_to_returns || products_being_edited ||
-           thief_count > 0) {
+    lockFactory();
+    metrics.returns_waiting++;
+    // a shutdown takes the products back whatever the factory's state
+    while (FactoryRules::returnsBlocked(RulesView(this)) && !cancelled) {
         if (!open_to_visitors) {
-//            std::cout << "Company Returning  " << pthread_self() << " "
-//                                                                    "WAITING "
-//                                                                    "VISITORS"
-//                                                                    "" <<
-//                      std::endl;
-            pthread_cond_wait(&open_to_visitors_cond, &factory_lock);
-        } else if (!open_to_returns) {
+            waitFactory(&open_to_visitors_cond);
+        } else if (returnsClosed()) {
+            // a company waiting for the returns service does not block
+            // simple buyers
             company_buyer_count--;
-//            std::cout << "Company Returning  " << pthread_self() << " "
-//                                                                    "WAITING "
-//                                                                    "RETURNS"
-//                                                                    "" <<
-//                      std::endl;
-            pthread_cond_wait(&open_to_returns_cond, &factory_lock);
+            waitFactory(&open_to_returns_cond);
             company_buyer_count++;
         } else {
-//            std::cout << "Company Returning  " << pthread_self() << " "
-//                                                                    "WAITING" <<
-//                      std::endl;
-            pthread_cond_wait(&products_cond, &factory_lock);
+            waitFactory(&products_cond);
         }
-//        std::cout << "Company Returning  " << pthread_self() << " "
-//                                                                " LOCKING" <<
-//                  std::endl;
-        pthread_mutex_lock(&factory_lock);
-    }
-    products_being_edited = true;
-    auto num_to_return = products.size();
-    for (int i = 0; i < num_to_return; ++i) {
-        available_products.push_back(products.front());
-        products.pop_front();
-    }
-    products_being_edited = false;
+    }
+    metrics.returns_waiting--;
+    // the returned list's nodes move into the inventory, nothing is copied
+    appendAvailable(&products, EventLog::RETURN);
+    fillOrders();
     company_buyer_count--;
-    pthread_cond_broadcast(&products_cond);
-//    std::cout << "Company Returning  " << pthread_self() << " "
-//                                                            " UNLOCKING DONE" <<
-//              std::endl;
-    pthread_mutex_unlock(&factory_lock);
+    wakeCompanies();
+    unlockFactory();
 }
 
 int Factory::finishCompanyBuyer(unsigned int id) {
+    if (company_buyer_threads.count(id) == 0) return 0;
     int *num_returned_ptr;
     int num_returned;
     pthread_join(*company_buyer_threads[id], (void **) &num_returned_ptr);
@@ -331,65 +1272,59 @@ int Factory::finishCompanyBuyer(unsigned int id) {
 }
 
 void *thiefFunc(void *arg) {
+    visitor_role = Schedule::THIEF;
+    visitor_id = static_cast<ThiefArgument *>(arg)->fake_id;
     auto factory = static_cast<ThiefArgument *>(arg)->factory;
     auto num_products = static_cast<ThiefArgument *>(arg)->num_products;
     auto fake_id = static_cast<ThiefArgument *>(arg)->fake_id;
     auto num_stolen_ptr = new int(
             factory->stealProducts(num_products, fake_id));
     delete static_cast<ThiefArgument *>(arg);
+    factory->visitorLeft();
     return num_stolen_ptr;
 }
 
 void Factory::startThief(int num_products, unsigned int fake_id) {
-    pthread_mutex_lock(&factory_lock);
-    thief_count++;
-    pthread_mutex_unlock(&factory_lock);
+    if (!admitVisitor()) return;
+    if (FactoryFeatures::THIEVES) {
+        lockFactory();
+        thief_count++;
+        unlockFactory();
+    }
     thief_threads[fake_id] = new pthread_t;
     auto arg = new ThiefArgument(this, num_products, fake_id);
-    pthread_create(thief_threads[fake_id], nullptr, thiefFunc, arg);
+    createVisitorThread(thief_threads[fake_id], thiefFunc, arg);
 }
 
 int Factory::stealProducts(int num_products, unsigned int fake_id) {
     int num_stolen_products = 0;
-//    std::cout << "Thief  " << pthread_self() << " LOCKING STARTED" << " - now "
-//                                                                         "" <<
-//                                                                      thief_count << " thieves"<<
-//                                                                      std::endl;
-    pthread_mutex_lock(&factory_lock);
-    while (!open_to_visitors || products_being_edited) {
-        if (!open_to_visitors) {
-//            std::cout << "Thief  " << pthread_self() << " WAITING VISITORS" <<
-//                      std::endl;
-            pthread_cond_wait(&open_to_visitors_cond, &factory_lock);
-        } else {
-//            std::cout << "Thief  " << pthread_self() << " WAITING" <<
-//                      std::endl;
-            pthread_cond_wait(&products_cond, &factory_lock);
-        }
-//        std::cout << "Thief  " << pthread_self() << " LOCKING" <<
-//                  std::endl;
-        pthread_mutex_lock(&factory_lock);
-    }
-    products_being_edited = true;
-    for (int i = 0; i < num_products && !available_products.empty(); ++i) {
-        std::pair<Product, int> pair = std::pair<Product, int>(
-                available_products.front(), static_cast<int>(fake_id));
-        stolen_products.push_back(pair);
-        available_products.pop_front();
+    if (!FactoryFeatures::THIEVES) return num_stolen_products;
+    lockFactory();
+    metrics.thieves_waiting++;
+    while (FactoryRules::thievesBlocked(RulesView(this)) && !cancelled) {
+        waitFactory(&open_to_visitors_cond);
+    }
+    metrics.thieves_waiting--;
+    // thieves come first, the staged products are theirs too
+    publishAllStaged();
+    for (int i = 0; i < num_products && open_to_visitors &&
+                    !available_products.empty(); ++i) {
+        recordStolen(popAvailable(EventLog::STEAL),
+                     static_cast<int>(fake_id));
         num_stolen_products++;
     }
-    products_being_edited = false;
-    thief_count--;
-    pthread_cond_broadcast(&products_cond);
-//    std::cout << "Thief  " << pthread_self() << " UNLOCKING DONE" << " - now "
-//                                                                     "" <<
-//              thief_count << " thieves"<<
-//              std::endl;
-    pthread_mutex_unlock(&factory_lock);
+    releaseSpace();
+    // company buyers wait for the last thief to leave
+    if (--thief_count == 0) {
+        wakeCompanies();
+        fillOrders();
+    }
+    unlockFactory();
     return num_stolen_products;
 }
 
 int Factory::finishThief(unsigned int fake_id) {
+    if (thief_threads.count(fake_id) == 0) return 0;
     int *num_stolen_ptr;
     int num_stolen;
     pthread_join(*thief_threads[fake_id], (void **) &num_stolen_ptr);
@@ -402,50 +1337,205 @@ int Factory::finishThief(unsigned int fake_id) {
 void Factory::closeFactory() {
 //    std::cout << "Primary CloseFactory  " << pthread_self() << " LOCKING" <<
 //              std::endl;
-    pthread_mutex_lock(&factory_lock);
+    lockFactory();
     this->open_to_visitors = false;
+    if (store) store->setOpenToVisitors(false);
 //    std::cout << "Primary CloseFactory  " << pthread_self() << " UNLOCKING" <<
 //              std::endl;
-    pthread_mutex_unlock(&factory_lock);
+    unlockFactory();
 }
 
 void Factory::openFactory() {
 //    std::cout << "Primary OpenFactory  " << pthread_self() << " LOCKING" <<
 //              std::endl;
-    pthread_mutex_lock(&factory_lock);
+    lockFactory();
     this->open_to_visitors = true;
-    pthread_cond_broadcast(&open_to_visitors_cond);
+    if (store) store->setOpenToVisitors(true);
+    open_to_visitors_cond.broadcast();
+    fillOrders();
 //    std::cout << "Primary OpenFactory  " << pthread_self() << " UNLOCKING" <<
 //              std::endl;
-    pthread_mutex_unlock(&factory_lock);
+    unlockFactory();
 }
 
 void Factory::closeReturningService() {
 //    std::cout << "Primary CloseReturning  " << pthread_self() << " LOCKING" <<
 //              std::endl;
-    pthread_mutex_lock(&factory_lock);
+    lockFactory();
     this->open_to_returns = false;
+    metrics.open_to_returns = false;
+    if (store) store->setOpenToReturns(false);
 //    std::cout << "Primary CloseReturning  " << pthread_self() << " UNLOCKING" <<
 //              std::endl;
-    pthread_mutex_unlock(&factory_lock);
+    unlockFactory();
 }
 
 void Factory::openReturningService() {
 //    std::cout << "Primary OpenReturning  " << pthread_self() << " LOCKING" <<
 //              std::endl;
-    pthread_mutex_lock(&factory_lock);
+    lockFactory();
     this->open_to_returns = true;
-    pthread_cond_broadcast(&open_to_returns_cond);
+    metrics.open_to_returns = true;
+    if (store) store->setOpenToReturns(true);
+    open_to_returns_cond.broadcast();
 //    std::cout << "Primary OpenReturning  " << pthread_self() << " UNLOCKING" <<
 //              std::endl;
-    pthread_mutex_unlock(&factory_lock);
+    unlockFactory();
 
 }
 
 std::list<std::pair<Product, int>> Factory::listStolenProducts() {
-    return stolen_products;
+    return stolen_products.toList();
 }
 
 std::list<Product> Factory::listAvailableProducts() {
     return available_products;
-}
\ No newline at end of file
+}
+
+void Factory::enableEventLog(const std::string &path,
+                             EventLog::Durability durability) {
+    auto log = new EventLog(path, durability);
+    lockFactory();
+    event_log.reset(log);
+    unlockFactory();
+}
+
+void Factory::flushEventLog() {
+    if (event_log) event_log->flush();
+}
+
+void Factory::recordSchedule() {
+    factory_lock.lock();
+    schedule.reset(new Schedule(Schedule::RECORD));
+    schedule_active = true;
+    updateStaging();
+    factory_lock.unlock();
+}
+
+void Factory::replaySchedule(const std::vector<Schedule::Event> &events) {
+    factory_lock.lock();
+    schedule.reset(new Schedule(Schedule::REPLAY, events));
+    schedule_active = true;
+    updateStaging();
+    factory_lock.unlock();
+}
+
+std::vector<Schedule::Event> Factory::stopSchedule() {
+    factory_lock.lock();
+    std::vector<Schedule::Event> events;
+    if (schedule) events = schedule->events();
+    schedule.reset();
+    schedule_active = false;
+    updateStaging();
+    schedule_cond.broadcast();
+    wakeCompanies();
+    open_to_visitors_cond.broadcast();
+    open_to_returns_cond.broadcast();
+    factory_lock.unlock();
+    return events;
+}
+
+void Factory::setThreadPlacement(bool pin) {
+    if (pin) {
+        topology.reset(new NumaTopology());
+        topology->restrictToAffinity();
+    } else {
+        topology.reset();
+    }
+    next_node = 0;
+}
+
+void Factory::checkpoint() {
+    std::string error;
+    lockFactory();
+    if (store) {
+        store->checkpoint();
+        error = store->writeError();
+    }
+    unlockFactory();
+    if (!error.empty()) throw std::runtime_error(error);
+}
+
+FactoryStats Factory::getStats() {
+    FactoryStats stats;
+    lockFactory();
+    stats.available_products = available_products.size();
+    stats.stolen_products = stolen_products.size();
+    stats.capacity = capacity;
+    stats.low_watermark = low_watermark;
+    stats.peak_available = peak_available;
+    stats.producers_waiting = space_waiters;
+    stats.producer_waits = producer_waits;
+    stats.staged_products = staged_count.load();
+    stats.handed_off = metrics.handed_off.load();
+    stats.reserved_products = 0;
+    for (auto &order : company_orders) {
+        stats.reserved_products += order.claimed.size();
+    }
+    unlockFactory();
+    return stats;
+}
+
+void Factory::renderMetrics(std::string *out) const {
+    auto line = [out](const char *name, const char *type, const char *help,
+                      const std::string &labels, unsigned long long value) {
+        // HELP and TYPE once per metric, before its first sample
+        if (help != nullptr) {
+            *out += std::string("# HELP ") + name + " " + help + "\n";
+            *out += std::string("# TYPE ") + name + " " + type + "\n";
+        }
+        *out += name + (labels.empty() ? "" : "{" + labels + "}") + " " +
+                std::to_string(value) + "\n";
+    };
+    line("factory_available_products", "gauge",
+         "Products buyers can buy now.", "", availableCount());
+    line("factory_staged_products", "gauge",
+         "Products in producer staging buffers.", "", staged_count.load());
+    line("factory_open", "gauge", "1 if the factory is open to visitors.",
+         "", open_to_visitors.load() ? 1 : 0);
+    line("factory_returns_open", "gauge",
+         "1 if the returns service is open.", "",
+         metrics.open_to_returns.load() ? 1 : 0);
+    line("factory_products_total", "counter",
+         "Products that entered or left the inventory, by event.",
+         "event=\"produced\"", metrics.produced.load());
+    line("factory_products_total", nullptr, nullptr, "event=\"bought\"",
+         metrics.bought.load());
+    line("factory_products_total", nullptr, nullptr, "event=\"returned\"",
+         metrics.returned.load());
+    line("factory_products_total", nullptr, nullptr, "event=\"stolen\"",
+         metrics.stolen.load());
+    line("factory_products_total", nullptr, nullptr, "event=\"recalled\"",
+         metrics.recalled.load());
+    line("factory_products_total", nullptr, nullptr, "event=\"recovered\"",
+         metrics.recovered.load());
+    line("factory_handed_off_products_total", "counter",
+         "Produced products handed straight to a waiting company buyer.",
+         "", metrics.handed_off.load());
+    line("factory_visitors_inside", "gauge",
+         "Visitors that keep simple buyers out.", "class=\"company\"",
+         company_buyer_count.load());
+    line("factory_visitors_inside", nullptr, nullptr, "class=\"thief\"",
+         thief_count.load());
+    line("factory_waiters", "gauge", "Visitors blocked in the factory.",
+         "class=\"producer\"", metrics.producers_waiting.load());
+    line("factory_waiters", nullptr, nullptr, "class=\"company\"",
+         metrics.companies_waiting.load());
+    line("factory_waiters", nullptr, nullptr,
+         "class=\"returning_company\"", metrics.returns_waiting.load());
+    line("factory_waiters", nullptr, nullptr, "class=\"thief\"",
+         metrics.thieves_waiting.load());
+    *out += "# HELP factory_wait_seconds Time visitors spent waiting.\n";
+    *out += "# TYPE factory_wait_seconds histogram\n";
+    metrics.company_wait.render("factory_wait_seconds", "class=\"company\"",
+                                out);
+    metrics.producer_wait.render("factory_wait_seconds",
+                                 "class=\"producer\"", out);
+}
+
+StolenLedger::ThiefTotals Factory::stolenTotals(unsigned int fake_id) {
+    lockFactory();
+    auto totals = stolen_products.totalsFor(static_cast<int>(fake_id));
+    unlockFactory();
+    return totals;
+}
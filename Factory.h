@@ -2,20 +2,172 @@
 #define FACTORY_H_
 
 #include <pthread.h>
+#include <atomic>
 #include <list>
 #include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "EventLog.h"
+#include "FactoryFeatures.h"
+#include "FactoryLock.h"
+#include "FactoryMetrics.h"
+#include "NumaTopology.h"
+#include "PersistentStore.h"
 #include "Product.h"
+#include "ProductIndex.h"
+#include "Schedule.h"
+#include "StolenLedger.h"
+
+// a snapshot of the factory's counters, see Factory::getStats
+struct FactoryStats {
+    std::size_t available_products;
+    std::size_t stolen_products;
+    // 0 when the inventory is unbounded
+    std::size_t capacity;
+    // blocked producers resume once the inventory drops to this size
+    std::size_t low_watermark;
+    // the largest inventory the factory ever had
+    std::size_t peak_available;
+    unsigned int producers_waiting;
+    // how many times a producer had to wait for space
+    unsigned long producer_waits;
+    // products claimed by company orders that are not complete yet
+    std::size_t reserved_products;
+    // products in the producers' staging buffers, see setStaging
+    std::size_t staged_products;
+    // products a producer handed straight to a waiting company buyer
+    unsigned long handed_off;
+};
+
+// what Factory::shutdown did
+struct ShutdownStatus {
+    // visitor threads joined
+    std::size_t joined;
+    // visitors still in the factory at the deadline, their waits were cut
+    std::size_t cancelled;
+};
+
+// what Factory::recallProducts found for the recalled ids
+struct RecallReport {
+    // the products taken out of the inventory
+    std::list<Product> recalled;
+    // ids with no available product that were stolen
+    std::vector<int> stolen;
+    // ids with no available product that were not stolen: sold, claimed
+    // by a company order, or never produced here
+    std::vector<int> sold;
+};
 
 class Factory {
-private:
-    pthread_cond_t open_to_visitors_cond;
-    bool open_to_visitors;
+public:
+    /*
+     * How waiting company buyers share the products, see
+     * setAdmissionPolicy:
+     *   GREEDY    any company with enough products buys, so small orders
+     *             can starve large ones
+     *   FIFO      companies buy in arrival order, the products are kept for
+     *             the oldest waiting order until it has enough
+     *   AGING     an order's priority grows by one every bound, and a
+     *             company may not buy while an order with a higher priority
+     *             waits
+     *   MAX_WAIT  GREEDY, until the oldest order has waited for bound, from
+     *             then on it is served first
+     */
+    enum AdmissionPolicy {
+        GREEDY,
+        FIFO,
+        AGING,
+        MAX_WAIT
+    };
+
+    static const char *admissionPolicyName(AdmissionPolicy policy);
 
-    pthread_cond_t open_to_returns_cond;
-    bool open_to_returns;
+private:
+    // the products a producer thread staged but did not publish yet
+    struct StagingBuffer {
+        StagingBuffer() : lock(FactoryLock::SPIN_THEN_PARK), oldest_ns(0) {}
+
+        FactoryLock lock;
+        std::list<Product> products;
+        // when the oldest staged product was staged
+        long long oldest_ns;
+    };
+
+    // a company buyer waiting in buyProducts
+    struct CompanyOrder {
+        CompanyOrder()
+                : num_products(0), arrival_ns(0), reserving(false),
+                  handed(false) {}
+
+        int num_products;
+        long long arrival_ns;
+        // set if the order claims products as they come, see setReservations
+        bool reserving;
+        // set once a producer handed the products over, see setHandOff
+        bool handed;
+        std::list<Product> claimed;
+        // the buyer of an order that does not reserve sleeps on its own
+        // condition, so a hand-off wakes only that buyer
+        FactoryCond ready;
+    };
+
+    /*
+     * The fields are grouped by who writes them, and the groups that threads
+     * outside the lock touch start on their own cache lines, so writing one
+     * group does not invalidate the line that threads poll in another.
+     *
+     * Read-mostly: the open flag and the visitor counts change only when
+     * visitors come and go, under factory_lock, but tryBuyOne reads them
+     * without it to fail fast. schedule_active is set while schedule is not
+     * null, lock-free paths are off while it is.
+     */
+    FACTORY_CACHE_ALIGNED std::atomic<bool> open_to_visitors;
+    std::atomic<bool> schedule_active;
+    std::atomic<unsigned int> thief_count;
+    std::atomic<unsigned int> company_buyer_count;
+
+    // written on every change to the products, also read by tryBuyOne
+    FACTORY_CACHE_ALIGNED std::atomic<std::size_t> available_count;
+    std::atomic<std::size_t> staged_count;
+
+    // read by every produce, see setStaging
+    FACTORY_CACHE_ALIGNED std::atomic<bool> staging_active;
+    std::atomic<std::size_t> staging_batch;
+    std::atomic<long long> staging_delay_ns;
+    // tells this factory's staging buffers apart in the threads' caches
+    unsigned long serial;
+
+    // the lock word, which waiters spin on
+    FACTORY_CACHE_ALIGNED FactoryLock factory_lock;
+
+    // bumped by every broadcast and wait, separate from the lock word
+    FACTORY_CACHE_ALIGNED FactoryCond products_cond;
+    FactoryCond open_to_visitors_cond;
+    FactoryCond open_to_returns_cond;
+    FactoryCond space_cond;
+    FactoryCond schedule_cond;
+    FactoryCond visitors_cond;
+
+    // counters for renderMetrics, written on every change to the products
+    FACTORY_CACHE_ALIGNED FactoryMetrics metrics;
+
+    // from here on, only the lock holder reads or writes
+    FACTORY_CACHE_ALIGNED bool open_to_returns;
+
+    // cleared by drain and shutdown, start functions admit no one after
+    bool admitting;
+    // set by shutdown, every wait in the factory gives up
+    bool cancelled;
+    // visitor threads that have not finished their visit yet
+    unsigned int active_visitors;
+
+    // the factory's available and stolen products
+    std::list<Product> available_products;
+    StolenLedger stolen_products;
+    // the available products by id, see recallProducts
+    ProductIndex product_index;
 
-    unsigned int thief_count;
-    unsigned int company_buyer_count;
     // the threads currently running and their locks
     std::map<unsigned int, pthread_t *> production_threads;
 //    pthread_mutex_t production_threads_lock;
@@ -33,13 +185,217 @@ private:
 //    pthread_mutex_t thief_threads_lock;
 //    pthread_mutexattr_t thief_threads_lock_attributes; // for initialization purposes
 
-    // the factory's available and stolen products, and their lock
-    std::list<Product> available_products;
-    std::list<std::pair<Product, int>> stolen_products;
-    bool products_being_edited;
-    pthread_cond_t products_cond;
-    pthread_mutex_t factory_lock;
-    pthread_mutexattr_t products_lock_attributes; // for initialization purposes
+    // the inventory limit, see setCapacity
+    std::size_t capacity;
+    std::size_t low_watermark;
+    unsigned int space_waiters;
+    std::size_t peak_available;
+    unsigned long producer_waits;
+
+    // the waiting company orders, oldest first, see setAdmissionPolicy
+    std::list<CompanyOrder> company_orders;
+    // orders that got their products from a producer, until their buyers
+    // pick them up
+    std::list<CompanyOrder> handed_orders;
+    AdmissionPolicy admission_policy;
+    long long admission_bound_ns;
+    bool reservations;
+    unsigned int reserving_orders;
+    // see setHandOff
+    bool hand_off;
+
+    // the producer threads' staging buffers, see setStaging
+    std::map<pthread_t, std::unique_ptr<StagingBuffer>> staging_buffers;
+
+    // the nodes visitor threads are spread over when pinning, else null
+    std::unique_ptr<NumaTopology> topology;
+    std::size_t next_node;
+
+    // mirror of the state above when the factory is persistent, else null
+    std::unique_ptr<PersistentStore> store;
+
+    // audit trail of the product events when enabled, else null
+    std::unique_ptr<EventLog> event_log;
+
+    // the schedule being recorded or replayed, else null
+    std::unique_ptr<Schedule> schedule;
+
+    // every visitor takes and waits on factory_lock through these
+    void lockFactory();
+
+    void unlockFactory();
+
+    void waitFactory(FactoryCond *cond);
+
+    // returns false without waiting if deadline_ns (monotonic) has passed
+    bool waitFactoryUntil(FactoryCond *cond, long long deadline_ns);
+
+    void awaitTurn(Schedule::EventKind kind);
+
+    // the factory's state as FactoryRules reads it, see FactoryRules.h
+    class RulesView {
+    public:
+        explicit RulesView(const Factory *factory) : factory(factory) {}
+
+        bool open() const {
+            return factory->open_to_visitors.load(std::memory_order_acquire);
+        }
+
+        // only read under the lock
+        bool returnsOpen() const {
+            return factory->open_to_returns;
+        }
+
+        unsigned int thieves() const {
+            return factory->thief_count.load(std::memory_order_acquire);
+        }
+
+        unsigned int companies() const {
+            return factory->company_buyer_count.load(
+                    std::memory_order_acquire);
+        }
+
+        std::size_t available() const {
+            return factory->available_count.load(std::memory_order_acquire);
+        }
+
+        // only read under the lock
+        std::size_t capacity() const {
+            return factory->capacity;
+        }
+
+    private:
+        const Factory *factory;
+    };
+
+    // always false in builds without thieves, see FactoryFeatures
+    bool thievesInside() const;
+
+    // always false in builds without a returns service
+    bool returnsClosed() const;
+
+    // true if simple buyers may not buy now, reads only the atomics
+    bool simpleBuyersBlocked();
+
+    /*
+     * Returns true if order may buy now. Otherwise sets *recheck_ns to the
+     * monotonic time at which the answer may change without a broadcast, or
+     * to 0 if only a broadcast can change it.
+     */
+    bool mayBuy(std::list<CompanyOrder>::iterator order,
+                long long *recheck_ns);
+
+    // hands available products to the reserving orders, oldest first
+    void fillOrders();
+
+    // the calling thread's staging buffer, created on first use
+    StagingBuffer *stagingBuffer();
+
+    // publishes and forgets the calling thread's buffer, when it is done
+    void dropStagingBuffer();
+
+    // stages the products, publishing them if a threshold is reached
+    void stageProducts(int num_products, Product *products);
+
+    // moves a buffer's products to the inventory, under factory_lock
+    void publishBuffer(StagingBuffer *buffer);
+
+    // publishes every buffer, under factory_lock
+    void publishAllStaged();
+
+    // publishes the buffers whose oldest product is past the delay
+    void publishExpired();
+
+    // turns staging on or off after its conditions changed, under the lock
+    void updateStaging();
+
+    // wakes the company buyers that may be waiting for new products
+    void productsAdded();
+
+    // wakes every buyer of an order that does not reserve, and the
+    // returning companies
+    void wakeCompanies();
+
+    /*
+     * Hands up to incoming new products straight to the waiting orders that
+     * may buy once they are added, oldest order first, and returns how many
+     * it handed. deliver(first, count, out) must move the new products
+     * first to first + count - 1 to the end of out.
+     */
+    template<class Deliver>
+    std::size_t handOff(std::size_t incoming, Deliver deliver);
+
+    // adds as many products as there is space for, returns how many
+    int insertProducts(int num_products, Product *products);
+
+    // like insertProducts, moves the inserted nodes out of products
+    std::size_t insertList(std::list<Product> *products);
+
+    // blocks until there is space, or until deadline_ns if it is not 0
+    bool waitForSpace(long long deadline_ns);
+
+    // wakes blocked producers once the inventory is down to low_watermark
+    void releaseSpace();
+
+    // every change to the products goes through these, under factory_lock
+    void pushAvailable(const Product &product, EventLog::EventType reason);
+
+    // moves the nodes of products to the end of the inventory
+    void appendAvailable(std::list<Product> *products,
+                         EventLog::EventType reason);
+
+    Product popAvailable(EventLog::EventType reason);
+
+    // moves the nodes of the num_products oldest products to the end of out
+    void takeAvailable(std::size_t num_products, std::list<Product> *out,
+                       EventLog::EventType reason);
+
+    void recordStolen(const Product &product, int fake_id);
+
+    // the event log and store side of the changes above
+    void noteAdded(const Product &product, EventLog::EventType reason);
+
+    void noteRemoved(const Product &product, EventLog::EventType reason);
+
+    // refreshes available_count and peak_available
+    void countAvailable();
+
+    /*
+     * The visit of a company buyer that was already counted in: buys, keeps
+     * the products worth at least min_value, returns the others and leaves.
+     * Returns the number of returned products.
+     */
+    int companyVisit(int num_products, int min_value, unsigned int id);
+
+    friend void *productionFunc(void *arg);
+
+    friend void *fileProductionFunc(void *arg);
+
+    friend void *simpleBuyerFunc(void *arg);
+
+    friend void *companyBuyerFunc(void *arg);
+
+    friend void *thiefFunc(void *arg);
+
+    // updates the metrics when a company order leaves buyProducts
+    void orderLeft(long long arrival_ns);
+
+    // logs and stores the recovery of a stolen product, adds it to recovered
+    void noteRecovered(std::size_t row, int id, int value, int fake_id,
+                       std::list<Product> *recovered);
+
+    // counts a new visitor thread in, false once the factory stopped admitting
+    bool admitVisitor();
+
+    // called by every visitor thread at the end of its visit
+    void visitorLeft();
+
+    // joins every visitor thread and forgets it, returns how many
+    std::size_t joinVisitors();
+
+    // starts a visitor thread, pinned to the next node if pinning is on
+    void createVisitorThread(pthread_t *thread, void *(*func)(void *),
+                             void *arg);
 
     void removeProductionThreadFromList(unsigned int id);
 
@@ -51,26 +407,182 @@ private:
 
 public:
 
-    Factory();
+    explicit Factory(FactoryLock::Policy lock_policy =
+                     FactoryLock::PTHREAD_MUTEX);
+
+    /*
+     * Creates a persistent factory backed by the store at store_path. If the
+     * store already holds a factory's state, the new factory attaches to it
+     * and starts with the same products and open/closed flags.
+     */
+    explicit Factory(const std::string &store_path);
 
+    // shuts the factory down at once if visitor threads are still running
     ~Factory();
 
+    Factory(const Factory &) = delete;
+
+    Factory &operator=(const Factory &) = delete;
+
     void startProduction(int num_products, Product *products, unsigned int id);
 
+    // blocks while the inventory is full, see setCapacity and setStaging
     void produce(int num_products, Product *products);
 
+    /*
+     * Produces every record of the ProductFile at path, in order, in chunks
+     * of 64Ki records that are added under one lock hold each. Products
+     * are built straight from the mapped file, without an intermediate
+     * array, and bypass staging. Blocks while the inventory is full, like
+     * produce. Returns the number of products added, or -1 if the file
+     * can not be mapped.
+     */
+    long produceFromFile(const std::string &path);
+
+    // runs produceFromFile in a producer thread, see finishProduction
+    void startFileProduction(const std::string &path, unsigned int id);
+
+    /*
+     * When batch_size is not 0, produce stops taking the factory lock for
+     * every call. Each producer thread appends to its own staging buffer,
+     * and publishes the buffer to the inventory, in order, once it holds
+     * batch_size products, once its oldest product waited for max_delay_ms,
+     * or at once if company buyers are inside. The delay is checked by the
+     * producer when it stages again and by every buyer that comes, so the
+     * buffer of a producer that went idle waits for the next buyer. Buyers
+     * that find the inventory empty pull the staged products themselves,
+     * and thieves publish every staged product before stealing. A producer
+     * thread started by startProduction publishes and drops its buffer when
+     * it finishes, the threads that call produce keep theirs. Staged
+     * products are not in listAvailableProducts, the event log or the store until
+     * they are published. Staging is off while the inventory has a
+     * capacity, or while a schedule is recorded or replayed.
+     */
+    void setStaging(std::size_t batch_size, long max_delay_ms);
+
+    // publishes every staged product now
+    void publishStaged();
+
+    // adds all the products if there is space for all of them, else none
+    bool tryProduce(int num_products, Product *products);
+
+    /*
+     * Like produce, but gives up after timeout_ms milliseconds. Returns how
+     * many of the products, from the first one on, were added.
+     */
+    int produceFor(int num_products, Product *products, long timeout_ms);
+
+    /*
+     * Limits the inventory to capacity products, 0 for no limit. Producers
+     * that find the inventory full wait until buyers and thieves bring it
+     * down to low_watermark products (by default, until there is any space).
+     * Returned products are always accepted, so they may exceed the limit.
+     * A company buyer that orders more than capacity products never gets
+     * them.
+     */
+    void setCapacity(std::size_t capacity, std::size_t low_watermark = 0);
+
     void finishProduction(unsigned int id);
 
     void startSimpleBuyer(unsigned int id);
 
+    /*
+     * Buys the oldest product, or returns -1 if the factory is closed, has no
+     * products, or has thieves or company buyers in it. A failing probe
+     * usually returns without taking the factory lock.
+     */
     int tryBuyOne();
 
+    /*
+     * Serves num_buyers simple buyers in one critical section. results[i]
+     * gets the product id bought by buyer i, or -1 exactly when tryBuyOne
+     * would have returned -1 for it. Returns the number of products bought.
+     */
+    int tryBuyMany(int num_buyers, int *results);
+
     int finishSimpleBuyer(unsigned int id);
 
     void startCompanyBuyer(int num_products, int min_value, unsigned int id);
 
     std::list<Product> buyProducts(int num_products);
 
+    /*
+     * Runs a company buyer in the calling thread, like startCompanyBuyer
+     * followed by finishCompanyBuyer, and returns the number of products it
+     * returned. It is admitted and counted like a visitor thread, so drain
+     * waits for it and shutdown cuts its wait short.
+     */
+    int runCompanyBuyer(int num_products, int min_value, unsigned int id);
+
+    // the number of available products, read without the factory lock
+    std::size_t availableCount() const;
+
+    /*
+     * Removes up to max_products of the oldest products, to move them to
+     * another factory. Takes nothing while the factory is closed or has
+     * company buyers or thieves in it.
+     */
+    std::list<Product> takeProducts(int max_products);
+
+    /*
+     * Moves up to max_products of the oldest products to the end of to's
+     * inventory, no more than to has space for, and returns how many. Both
+     * factories are locked at once, so the products are always in one of
+     * them. Takes nothing when takeProducts would take nothing.
+     */
+    std::size_t moveProductsTo(Factory &to, int max_products);
+
+    /*
+     * Removes every available product with one of ids, whatever the
+     * factory's state, and reports the ids that had no available product.
+     * Staged products are published first, so they are recalled too. Each
+     * id costs a hash lookup, only the ids that were not found cost a scan
+     * of the stolen products.
+     */
+    RecallReport recallProducts(const std::vector<int> &ids);
+
+    /*
+     * Moves every product the thief fake_id stole back to the end of the
+     * available products, in the order they were stolen, and returns how
+     * many there were. Like returns, recoveries ignore the capacity.
+     * Waiting company buyers are woken once for the whole batch. The cost
+     * is proportional to the products recovered.
+     */
+    std::size_t recoverStolen(unsigned int fake_id);
+
+    // like recoverStolen for every thief, thief by thief by fake_id
+    std::size_t recoverAllStolen();
+
+    /*
+     * Sets how waiting company buyers are admitted. bound_ms is the aging
+     * step of AGING and the longest wait of MAX_WAIT, and is ignored by the
+     * other policies. Under FIFO, and under the others once an order is old
+     * enough, an order larger than the capacity blocks every company.
+     */
+    void setAdmissionPolicy(AdmissionPolicy policy, long bound_ms = 0);
+
+    /*
+     * When enabled, a company buyer that arrives claims products as they
+     * are produced or returned, oldest order first, and leaves once it
+     * claimed all of them. Thieves can only steal unclaimed products, and
+     * nothing is claimed while a thief is in the factory or it is closed.
+     * Reserving orders are always filled in arrival order, the admission
+     * policy only applies to the orders that do not reserve.
+     */
+    void setReservations(bool enabled);
+
+    /*
+     * When enabled, which is the default, a producer that brings enough
+     * products for a waiting company order that does not reserve hands them
+     * straight to it: the order gets the available products first, then
+     * the new ones, as if they had been added and bought at once, and only
+     * its buyer is woken. Nothing is handed while a thief is in the factory,
+     * while it is closed, or while a reserving order waits. The admission
+     * policy decides which order gets the products. Returned and recovered
+     * products always go to the inventory.
+     */
+    void setHandOff(bool enabled);
+
     void returnProducts(std::list<Product> products, unsigned int id);
 
     int finishCompanyBuyer(unsigned int id);
@@ -92,6 +604,92 @@ public:
     std::list<std::pair<Product, int>> listStolenProducts();
 
     std::list<Product> listAvailableProducts();
+
+    /*
+     * Starts logging every produce, buy, return and steal to the event log at
+     * path. The log can be replayed with EventLog::replay.
+     */
+    void enableEventLog(const std::string &path,
+                        EventLog::Durability durability);
+
+    // waits until the logged events are on disk, does nothing without a log
+    void flushEventLog();
+
+    /*
+     * Starts recording the order in which threads take the factory lock and
+     * wake up in the factory. Threads are named by their role and id, so
+     * visitors should be started after the recording starts.
+     */
+    void recordSchedule();
+
+    /*
+     * Forces the factory's threads to take the lock in the order of events,
+     * as returned by stopSchedule() of a run of the same program.
+     */
+    void replaySchedule(const std::vector<Schedule::Event> &events);
+
+    // ends recording or replaying and returns the recorded events
+    std::vector<Schedule::Event> stopSchedule();
+
+    /*
+     * When enabled, every visitor thread started from now on is pinned to
+     * the CPUs of one NUMA node, spreading the visitors over the nodes in
+     * turn. Products are allocated by the thread that adds them, so pinned
+     * producers keep their products on their own node. On a machine with a
+     * single node the threads may still run on any allowed CPU.
+     */
+    void setThreadPlacement(bool pin);
+
+    /*
+     * Stops admitting visitors, waits until every visitor thread finished
+     * and joins them all, and returns how many there were. Also waits for
+     * the runCompanyBuyer calls in other threads. Visitors that
+     * wait for products that never come keep drain waiting, see shutdown.
+     * The start functions do nothing afterwards, and the finish functions
+     * of joined or refused visitors return -1 for simple buyers, 0 else.
+     */
+    std::size_t drain();
+
+    /*
+     * Like drain, but only lets the visitors finish for up to timeout_ms
+     * milliseconds. Then every wait in the factory is cut short: company
+     * buyers leave with nothing, returned products are taken back even if
+     * the factory or the returns service is closed, producers drop the
+     * products there is no space for and thieves that wait for the factory
+     * to open steal nothing. All the waiters are woken at once, so the time
+     * to shut down does not grow with their number.
+     */
+    ShutdownStatus shutdown(long timeout_ms);
+
+    /*
+     * Makes the persistent state durable, does nothing without a store.
+     * Throws std::runtime_error if the store could not follow the factory,
+     * e.g. because the disk is full. The factory keeps working then, but
+     * the store only holds the state from before the failed write.
+     */
+    void checkpoint();
+
+    StolenLedger::ThiefTotals stolenTotals(unsigned int fake_id);
+
+    FactoryStats getStats();
+
+    /*
+     * Appends the factory's metrics to out in the Prometheus text format.
+     * Reads only atomics, so it never waits for the factory lock and can
+     * be called while visitors are inside, see MetricsExporter.
+     */
+    void renderMetrics(std::string *out) const;
+
+    /*
+     * Streams the stolen products ledger without copying it, calling
+     * visit(product_id, product_value, fake_id) for every stolen product.
+     */
+    template<class Visitor>
+    void forEachStolenProduct(Visitor visit) {
+        lockFactory();
+        stolen_products.forEach(visit);
+        unlockFactory();
+    }
 };
 
 #endif // FACTORY_H_
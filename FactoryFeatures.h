@@ -0,0 +1,32 @@
+#ifndef FACTORY_FEATURES_H_
+#define FACTORY_FEATURES_H_
+
+/*
+ * The visitor classes a build of the factory supports, fixed at compile
+ * time. A deployment that never has thieves, or never closes its returns
+ * service, can build with -DFACTORY_WITHOUT_THIEVES or
+ * -DFACTORY_WITHOUT_RETURNS. The factory's checks for that class are then
+ * constant and the compiler removes them from the hot paths.
+ *   THIEVES  without them, thieves steal nothing and never hold buyers back
+ *   RETURNS  without it, returns are always accepted, closing the returns
+ *            service has no effect
+ * Only the visitor classes are fixed. The lock policy and the admission
+ * policy stay runtime choices, see FactoryLock::Policy and
+ * Factory::setAdmissionPolicy. The factory_bench_minimal target builds the
+ * benchmark with both macros defined.
+ */
+struct FactoryFeatures {
+#ifdef FACTORY_WITHOUT_THIEVES
+    static constexpr bool THIEVES = false;
+#else
+    static constexpr bool THIEVES = true;
+#endif
+
+#ifdef FACTORY_WITHOUT_RETURNS
+    static constexpr bool RETURNS = false;
+#else
+    static constexpr bool RETURNS = true;
+#endif
+};
+
+#endif // FACTORY_FEATURES_H_
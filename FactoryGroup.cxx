@@ -0,0 +1,213 @@
+#include "FactoryGroup.h"
+#include <algorithm>
+#include <time.h>
+
+static long long monotonicNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+FactoryGroup::FactoryGroup(std::size_t num_factories, std::size_t num_workers,
+                           long rebalance_interval_ms,
+                           FactoryLock::Policy lock_policy)
+        : running_tasks(0), stopping(false),
+          rebalance_interval_ns(rebalance_interval_ms * 1000000LL),
+          orders_routed(0), next_order_id(0), products_rebalanced(0) {
+    for (std::size_t i = 0; i < num_factories; ++i) {
+        factories.emplace_back(new Factory(lock_policy));
+    }
+    workers.resize(num_workers);
+    for (auto &worker : workers) {
+        pthread_create(&worker, nullptr, workerFunc, this);
+    }
+    if (rebalance_interval_ns > 0) {
+        pthread_create(&rebalancer, nullptr, rebalancerFunc, this);
+    }
+}
+
+FactoryGroup::~FactoryGroup() {
+    group_lock.lock();
+    stopping = true;
+    tasks_cond.broadcast();
+    group_lock.unlock();
+    // orders that can not be filled would keep their workers forever, and
+    // the orders queued behind them would never start
+    for (auto &factory : factories) factory->shutdown(0);
+    for (auto &worker : workers) pthread_join(worker, nullptr);
+    if (rebalance_interval_ns > 0) pthread_join(rebalancer, nullptr);
+}
+
+std::size_t FactoryGroup::size() const {
+    return factories.size();
+}
+
+Factory &FactoryGroup::factory(std::size_t index) {
+    return *factories[index];
+}
+
+void *FactoryGroup::workerFunc(void *arg) {
+    static_cast<FactoryGroup *>(arg)->runWorker();
+    return nullptr;
+}
+
+void *FactoryGroup::rebalancerFunc(void *arg) {
+    static_cast<FactoryGroup *>(arg)->runRebalancer();
+    return nullptr;
+}
+
+void FactoryGroup::runWorker() {
+    group_lock.lock();
+    while (true) {
+        while (tasks.empty() && !stopping) tasks_cond.wait(group_lock);
+        // the queue is drained before the workers stop
+        if (tasks.empty()) break;
+        auto task = std::move(tasks.front());
+        tasks.pop_front();
+        running_tasks++;
+        group_lock.unlock();
+        task();
+        group_lock.lock();
+        running_tasks--;
+        if (tasks.empty() && running_tasks == 0) idle_cond.broadcast();
+    }
+    group_lock.unlock();
+}
+
+void FactoryGroup::runRebalancer() {
+    group_lock.lock();
+    long long next_ns = monotonicNs() + rebalance_interval_ns;
+    while (!stopping) {
+        long long remaining_ns = next_ns - monotonicNs();
+        if (remaining_ns > 0) {
+            tasks_cond.waitFor(group_lock, remaining_ns);
+            continue;
+        }
+        group_lock.unlock();
+        rebalance();
+        group_lock.lock();
+        next_ns = monotonicNs() + rebalance_interval_ns;
+    }
+    group_lock.unlock();
+}
+
+void FactoryGroup::submit(std::function<void()> task) {
+    group_lock.lock();
+    tasks.push_back(std::move(task));
+    tasks_cond.broadcast();
+    group_lock.unlock();
+}
+
+void FactoryGroup::waitIdle() {
+    group_lock.lock();
+    while (!tasks.empty() || running_tasks > 0) idle_cond.wait(group_lock);
+    group_lock.unlock();
+}
+
+std::size_t FactoryGroup::route(int num_products) {
+    std::size_t best = 0;
+    std::size_t best_count = 0;
+    for (std::size_t i = 0; i < factories.size(); ++i) {
+        std::size_t count = factories[i]->availableCount();
+        if (count > best_count) {
+            best = i;
+            best_count = count;
+            // no factory has more than it needs to serve the order
+            if (count >= static_cast<std::size_t>(num_products) * 2) break;
+        }
+    }
+    return best;
+}
+
+void FactoryGroup::submitCompanyOrder(
+        int num_products, int min_value,
+        std::function<void(std::size_t, int)> done) {
+    std::size_t index = route(num_products);
+    group_lock.lock();
+    orders_routed++;
+    auto id = static_cast<unsigned int>(next_order_id++);
+    group_lock.unlock();
+    Factory *target = factories[index].get();
+    submit([target, index, num_products, min_value, id, done]() {
+        int returned = target->runCompanyBuyer(num_products, min_value, id);
+        if (done) done(index, returned);
+    });
+}
+
+unsigned long FactoryGroup::rebalance(std::size_t threshold) {
+    std::vector<std::pair<std::size_t, std::size_t>> counts;
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < factories.size(); ++i) {
+        counts.emplace_back(factories[i]->availableCount(), i);
+        total += counts.back().first;
+    }
+    if (counts.size() < 2) return 0;
+    std::sort(counts.begin(), counts.end());
+    // the rich give down to the average, the poor take up to it
+    std::size_t low_average = total / counts.size();
+    std::size_t high_average = low_average +
+                               (total % counts.size() == 0 ? 0 : 1);
+    unsigned long moved = 0;
+    std::size_t poor = 0;
+    std::size_t rich = counts.size() - 1;
+    while (poor < rich &&
+           counts[rich].first > counts[poor].first + threshold) {
+        if (counts[rich].first <= low_average) {
+            rich--;
+            continue;
+        }
+        if (counts[poor].first >= high_average) {
+            poor++;
+            continue;
+        }
+        std::size_t amount = std::min(counts[rich].first - low_average,
+                                      high_average - counts[poor].first);
+        Factory &from = *factories[counts[rich].second];
+        Factory &to = *factories[counts[poor].second];
+        std::size_t batch = from.moveProductsTo(to, static_cast<int>(amount));
+        if (batch == 0) {
+            if (from.availableCount() == 0) {
+                // emptied meanwhile
+                rich--;
+            } else {
+                // the target is full, or the factory is busy
+                poor++;
+            }
+            continue;
+        }
+        moved += batch;
+        counts[rich].first -= batch;
+        counts[poor].first += batch;
+    }
+    group_lock.lock();
+    products_rebalanced += moved;
+    group_lock.unlock();
+    return moved;
+}
+
+FactoryGroupStats FactoryGroup::getStats() {
+    FactoryGroupStats stats = FactoryGroupStats();
+    bool bounded = true;
+    for (auto &factory : factories) {
+        FactoryStats factory_stats = factory->getStats();
+        stats.totals.available_products += factory_stats.available_products;
+        stats.totals.stolen_products += factory_stats.stolen_products;
+        stats.totals.capacity += factory_stats.capacity;
+        stats.totals.low_watermark += factory_stats.low_watermark;
+        stats.totals.peak_available += factory_stats.peak_available;
+        stats.totals.producers_waiting += factory_stats.producers_waiting;
+        stats.totals.producer_waits += factory_stats.producer_waits;
+        stats.totals.reserved_products += factory_stats.reserved_products;
+        stats.totals.staged_products += factory_stats.staged_products;
+        stats.totals.handed_off += factory_stats.handed_off;
+        if (factory_stats.capacity == 0) bounded = false;
+    }
+    if (!bounded) stats.totals.capacity = 0;
+    stats.factories = factories.size();
+    group_lock.lock();
+    stats.orders_routed = orders_routed;
+    stats.products_rebalanced = products_rebalanced;
+    stats.queued_tasks = tasks.size();
+    group_lock.unlock();
+    return stats;
+}
@@ -0,0 +1,115 @@
+#ifndef FACTORY_GROUP_H_
+#define FACTORY_GROUP_H_
+
+#include <pthread.h>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "Factory.h"
+
+// a snapshot of a group's counters, see FactoryGroup::getStats
+struct FactoryGroupStats {
+    // the sums of the factories' counters, capacity is 0 if any is unbounded
+    FactoryStats totals;
+    std::size_t factories;
+    unsigned long orders_routed;
+    unsigned long products_rebalanced;
+    std::size_t queued_tasks;
+};
+
+/*
+ * Several independent factories that share one pool of worker threads.
+ * Company orders are routed to the factory with the most available
+ * products, and a background thread moves products from the fullest
+ * factories to the emptiest ones. The factories can still be used directly,
+ * through factory().
+ */
+class FactoryGroup {
+public:
+    /*
+     * Creates num_factories factories and num_workers worker threads. If
+     * rebalance_interval_ms is not 0, the factories are rebalanced that
+     * often.
+     */
+    FactoryGroup(std::size_t num_factories, std::size_t num_workers,
+                 long rebalance_interval_ms = 0,
+                 FactoryLock::Policy lock_policy = FactoryLock::PTHREAD_MUTEX);
+
+    /*
+     * Shuts every factory down first, so orders that can not be filled
+     * leave with nothing and the company orders still in the queue are
+     * refused: their done callbacks see 0 returned products. The other
+     * queued tasks still run, then the workers stop.
+     */
+    ~FactoryGroup();
+
+    FactoryGroup(const FactoryGroup &) = delete;
+
+    FactoryGroup &operator=(const FactoryGroup &) = delete;
+
+    std::size_t size() const;
+
+    Factory &factory(std::size_t index);
+
+    // runs task on one of the workers
+    void submit(std::function<void()> task);
+
+    // blocks until every submitted task finished
+    void waitIdle();
+
+    /*
+     * A factory for an order of num_products: the first one with at least
+     * twice that many available products, else the one with the most.
+     */
+    std::size_t route(int num_products);
+
+    /*
+     * Routes a company order and runs its buyer on a worker. done, if set,
+     * is called on the worker with the factory's index and the number of
+     * returned products. An order that no factory can fill keeps its worker
+     * until the products arrive or the group is destroyed, and so do the
+     * orders queued behind it.
+     */
+    void submitCompanyOrder(int num_products, int min_value,
+                            std::function<void(std::size_t, int)> done =
+                                    nullptr);
+
+    /*
+     * Moves products from factories above the average inventory to the
+     * ones below it, until no two differ by more than threshold products.
+     * Returns how many products were moved.
+     */
+    unsigned long rebalance(std::size_t threshold = 1);
+
+    FactoryGroupStats getStats();
+
+private:
+    static void *workerFunc(void *arg);
+
+    static void *rebalancerFunc(void *arg);
+
+    void runWorker();
+
+    void runRebalancer();
+
+    std::vector<std::unique_ptr<Factory>> factories;
+
+    // guards everything below
+    FactoryLock group_lock;
+    FactoryCond tasks_cond;
+    FactoryCond idle_cond;
+    std::deque<std::function<void()>> tasks;
+    std::size_t running_tasks;
+    bool stopping;
+    std::vector<pthread_t> workers;
+
+    long long rebalance_interval_ns;
+    pthread_t rebalancer;
+    unsigned long orders_routed;
+    unsigned long next_order_id;
+    unsigned long products_rebalanced;
+};
+
+#endif // FACTORY_GROUP_H_
@@ -0,0 +1,243 @@
+#include "FactoryLock.h"
+#include <climits>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+const int FactoryLock::SPIN_LIMIT;
+
+namespace {
+void futexWait(std::atomic<uint32_t> *word, uint32_t expected,
+               const struct timespec *timeout = nullptr) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT_PRIVATE,
+            expected, timeout, nullptr, 0);
+}
+
+void futexWake(std::atomic<uint32_t> *word, int count) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE_PRIVATE,
+            count, nullptr, nullptr, 0);
+}
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/*
+ * MCS queue nodes of the current thread, one per lock it holds at once.
+ * Bit i of used_mcs_nodes is set while node i is queued, so locks can be
+ * released in any order.
+ */
+const int MAX_HELD_MCS_NODES = 4;
+thread_local uint32_t used_mcs_nodes = 0;
+}
+
+FactoryLock::FactoryLock(Policy policy)
+        : lock_policy(policy), state(0), next_ticket(0), now_serving(0),
+          ticket_sleepers(0), tail(nullptr), owner(nullptr) {
+    pthread_mutex_init(&mutex, nullptr);
+}
+
+FactoryLock::~FactoryLock() {
+    pthread_mutex_destroy(&mutex);
+}
+
+FactoryLock::Policy FactoryLock::policy() const {
+    return lock_policy;
+}
+
+const char *FactoryLock::policyName(Policy policy) {
+    switch (policy) {
+        case PTHREAD_MUTEX:
+            return "pthread-mutex";
+        case SPIN_THEN_PARK:
+            return "spin-then-park";
+        case TICKET:
+            return "ticket";
+        case MCS:
+            return "mcs";
+    }
+    return "unknown";
+}
+
+void FactoryLock::lock() {
+    switch (lock_policy) {
+        case PTHREAD_MUTEX:
+            pthread_mutex_lock(&mutex);
+            break;
+        case SPIN_THEN_PARK:
+            lockSpinThenPark();
+            break;
+        case TICKET:
+            lockTicket();
+            break;
+        case MCS:
+            lockMcs();
+            break;
+    }
+}
+
+void FactoryLock::unlock() {
+    switch (lock_policy) {
+        case PTHREAD_MUTEX:
+            pthread_mutex_unlock(&mutex);
+            break;
+        case SPIN_THEN_PARK:
+            unlockSpinThenPark();
+            break;
+        case TICKET:
+            unlockTicket();
+            break;
+        case MCS:
+            unlockMcs();
+            break;
+    }
+}
+
+void FactoryLock::lockSpinThenPark() {
+    uint32_t current = 0;
+    if (state.compare_exchange_strong(current, 1)) return;
+    for (int i = 0; i < SPIN_LIMIT; ++i) {
+        cpuRelax();
+        current = 0;
+        if (state.load(std::memory_order_relaxed) == 0 &&
+            state.compare_exchange_strong(current, 1)) {
+            return;
+        }
+    }
+    // from now on the holder must wake someone when it unlocks
+    current = state.exchange(2);
+    while (current != 0) {
+        futexWait(&state, 2);
+        current = state.exchange(2);
+    }
+}
+
+void FactoryLock::unlockSpinThenPark() {
+    if (state.fetch_sub(1) != 1) {
+        state.store(0);
+        futexWake(&state, 1);
+    }
+}
+
+void FactoryLock::lockTicket() {
+    uint32_t ticket = next_ticket.fetch_add(1);
+    for (int i = 0; i < SPIN_LIMIT; ++i) {
+        if (now_serving.load(std::memory_order_acquire) == ticket) return;
+        cpuRelax();
+    }
+    ticket_sleepers.fetch_add(1);
+    uint32_t serving;
+    while ((serving = now_serving.load()) != ticket) {
+        futexWait(&now_serving, serving);
+    }
+    ticket_sleepers.fetch_sub(1);
+}
+
+void FactoryLock::unlockTicket() {
+    now_serving.fetch_add(1);
+    // sleepers can not tell whose turn it is, so all of them check
+    if (ticket_sleepers.load() > 0) futexWake(&now_serving, INT_MAX);
+}
+
+FactoryLock::McsNode *FactoryLock::threadNodes() {
+    thread_local McsNode nodes[MAX_HELD_MCS_NODES];
+    return nodes;
+}
+
+FactoryLock::McsNode *FactoryLock::acquireNode() {
+    for (int i = 0; i < MAX_HELD_MCS_NODES; ++i) {
+        if ((used_mcs_nodes & (1u << i)) == 0) {
+            used_mcs_nodes |= 1u << i;
+            return &threadNodes()[i];
+        }
+    }
+    // more MCS locks held at once than the thread has nodes for
+    return new McsNode;
+}
+
+void FactoryLock::releaseNode(McsNode *node) {
+    McsNode *nodes = threadNodes();
+    if (node >= nodes && node < nodes + MAX_HELD_MCS_NODES) {
+        used_mcs_nodes &= ~(1u << (node - nodes));
+    } else {
+        delete node;
+    }
+}
+
+void FactoryLock::lockMcs() {
+    McsNode *node = acquireNode();
+    node->next.store(nullptr, std::memory_order_relaxed);
+    // 1 while waiting, 2 while sleeping, 0 once the lock is handed over
+    node->locked.store(1, std::memory_order_relaxed);
+    McsNode *predecessor = tail.exchange(node, std::memory_order_acq_rel);
+    if (predecessor != nullptr) {
+        predecessor->next.store(node, std::memory_order_release);
+        int spins = 0;
+        while (node->locked.load(std::memory_order_acquire) != 0) {
+            if (spins++ < SPIN_LIMIT) {
+                cpuRelax();
+                continue;
+            }
+            uint32_t waiting = 1;
+            if (node->locked.compare_exchange_strong(waiting, 2) ||
+                waiting == 2) {
+                futexWait(&node->locked, 2);
+            }
+        }
+    }
+    owner = node;
+}
+
+void FactoryLock::unlockMcs() {
+    McsNode *node = owner;
+    McsNode *successor = node->next.load(std::memory_order_acquire);
+    if (successor == nullptr) {
+        McsNode *expected = node;
+        if (tail.compare_exchange_strong(expected, nullptr,
+                                         std::memory_order_acq_rel)) {
+            releaseNode(node);
+            return;
+        }
+        // a waiter is between joining the queue and linking itself
+        while ((successor = node->next.load(std::memory_order_acquire)) ==
+               nullptr) {
+            cpuRelax();
+        }
+    }
+    // the successor never touches node again
+    releaseNode(node);
+    if (successor->locked.exchange(0, std::memory_order_acq_rel) == 2) {
+        futexWake(&successor->locked, 1);
+    }
+}
+
+FactoryCond::FactoryCond() : sequence(0), waiters(0) {}
+
+void FactoryCond::wait(FactoryLock &lock) {
+    uint32_t seen = sequence.load();
+    waiters.fetch_add(1);
+    lock.unlock();
+    futexWait(&sequence, seen);
+    waiters.fetch_sub(1);
+    lock.lock();
+}
+
+void FactoryCond::waitFor(FactoryLock &lock, long long timeout_ns) {
+    struct timespec timeout;
+    timeout.tv_sec = timeout_ns / 1000000000;
+    timeout.tv_nsec = timeout_ns % 1000000000;
+    uint32_t seen = sequence.load();
+    waiters.fetch_add(1);
+    lock.unlock();
+    futexWait(&sequence, seen, &timeout);
+    waiters.fetch_sub(1);
+    lock.lock();
+}
+
+void FactoryCond::broadcast() {
+    sequence.fetch_add(1);
+    if (waiters.load() > 0) futexWake(&sequence, INT_MAX);
+}
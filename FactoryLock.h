@@ -0,0 +1,130 @@
+#ifndef FACTORY_LOCK_H_
+#define FACTORY_LOCK_H_
+
+#include <pthread.h>
+#include <atomic>
+#include <cstdint>
+
+/*
+ * Fields that threads poll without holding the factory lock start a new
+ * cache line, so that writes to their neighbours do not steal the line.
+ * Define FACTORY_PACKED_LAYOUT to pack them instead, for comparison.
+ */
+#ifndef FACTORY_CACHE_LINE_SIZE
+#define FACTORY_CACHE_LINE_SIZE 64
+#endif
+
+#ifdef FACTORY_PACKED_LAYOUT
+#define FACTORY_CACHE_ALIGNED
+#else
+#define FACTORY_CACHE_ALIGNED alignas(FACTORY_CACHE_LINE_SIZE)
+#endif
+
+/*
+ * The factory's lock, with a policy chosen when the factory is created:
+ *   PTHREAD_MUTEX   a plain pthread mutex
+ *   SPIN_THEN_PARK  spins for a bounded time, then sleeps on a futex
+ *   TICKET          FIFO ticket lock, spins then sleeps on the ticket word
+ *   MCS             FIFO queue lock, every waiter spins then sleeps on its
+ *                   own queue node, so waiters do not share a cache line
+ * The critical sections of the factory are short, so the spinning policies
+ * usually get the lock before a pthread mutex would have gone to sleep.
+ */
+class FactoryLock {
+public:
+    enum Policy {
+        PTHREAD_MUTEX,
+        SPIN_THEN_PARK,
+        TICKET,
+        MCS
+    };
+
+    // how many times a waiter checks the lock before it sleeps
+    static const int SPIN_LIMIT = 200;
+
+    explicit FactoryLock(Policy policy = PTHREAD_MUTEX);
+
+    ~FactoryLock();
+
+    FactoryLock(const FactoryLock &) = delete;
+
+    FactoryLock &operator=(const FactoryLock &) = delete;
+
+    Policy policy() const;
+
+    void lock();
+
+    void unlock();
+
+    static const char *policyName(Policy policy);
+
+private:
+    struct McsNode {
+        std::atomic<McsNode *> next;
+        std::atomic<uint32_t> locked;
+    };
+
+    void lockSpinThenPark();
+
+    void unlockSpinThenPark();
+
+    void lockTicket();
+
+    void unlockTicket();
+
+    void lockMcs();
+
+    void unlockMcs();
+
+    // the calling thread's MCS queue nodes, MAX_HELD_MCS_NODES of them
+    static McsNode *threadNodes();
+
+    // a free node of the calling thread, or a new one if all are in use
+    static McsNode *acquireNode();
+
+    // called once no other thread can reach node
+    static void releaseNode(McsNode *node);
+
+    Policy lock_policy;
+    pthread_mutex_t mutex;
+    // SPIN_THEN_PARK: 0 free, 1 locked, 2 locked with sleepers
+    std::atomic<uint32_t> state;
+    // TICKET, arriving threads take tickets while waiters poll now_serving
+    std::atomic<uint32_t> next_ticket;
+    FACTORY_CACHE_ALIGNED std::atomic<uint32_t> now_serving;
+    std::atomic<uint32_t> ticket_sleepers;
+    // MCS, arriving threads swap tail while the holder writes owner
+    FACTORY_CACHE_ALIGNED std::atomic<McsNode *> tail;
+    FACTORY_CACHE_ALIGNED McsNode *owner;
+};
+
+/*
+ * Condition variable that works with every FactoryLock policy.
+ * Waiters sleep on a futex over a sequence number that every broadcast
+ * bumps, so a broadcast sent between unlocking and sleeping is never lost.
+ * There is no single-waiter signal: the factory's waiters wait for different
+ * predicates, so waking one of them could wake the wrong one. Like pthread
+ * condition variables, waits may return spuriously.
+ */
+class FactoryCond {
+public:
+    FactoryCond();
+
+    FactoryCond(const FactoryCond &) = delete;
+
+    FactoryCond &operator=(const FactoryCond &) = delete;
+
+    // must be called with lock held, returns with lock held
+    void wait(FactoryLock &lock);
+
+    // like wait, but returns after at most timeout_ns nanoseconds
+    void waitFor(FactoryLock &lock, long long timeout_ns);
+
+    void broadcast();
+
+private:
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint32_t> waiters;
+};
+
+#endif // FACTORY_LOCK_H_
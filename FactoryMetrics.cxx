@@ -0,0 +1,51 @@
+#include "FactoryMetrics.h"
+#include <cstdio>
+
+const int LatencyHistogram::BUCKETS;
+
+namespace {
+const long long BUCKET_BOUNDS_NS[LatencyHistogram::BUCKETS] = {
+        10000LL, 100000LL, 1000000LL, 10000000LL, 100000000LL, 1000000000LL,
+        10000000000LL};
+
+const char *BUCKET_LABELS[LatencyHistogram::BUCKETS] = {
+        "1e-05", "0.0001", "0.001", "0.01", "0.1", "1", "10"};
+}
+
+LatencyHistogram::LatencyHistogram() : sum_ns(0) {
+    for (auto &count : counts) count.store(0);
+}
+
+void LatencyHistogram::record(long long ns) {
+    int bucket = 0;
+    while (bucket < BUCKETS && ns > BUCKET_BOUNDS_NS[bucket]) bucket++;
+    counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    sum_ns.fetch_add(ns, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::render(const std::string &name,
+                              const std::string &labels,
+                              std::string *out) const {
+    std::string prefix = labels.empty() ? "" : labels + ",";
+    // Prometheus buckets are cumulative
+    unsigned long cumulative = 0;
+    for (int i = 0; i <= BUCKETS; ++i) {
+        cumulative += counts[i].load(std::memory_order_relaxed);
+        *out += name + "_bucket{" + prefix + "le=\"" +
+                (i < BUCKETS ? BUCKET_LABELS[i] : "+Inf") + "\"} " +
+                std::to_string(cumulative) + "\n";
+    }
+    char sum[32];
+    std::snprintf(sum, sizeof(sum), "%.9f",
+                  sum_ns.load(std::memory_order_relaxed) / 1e9);
+    std::string braces = labels.empty() ? "" : "{" + labels + "}";
+    *out += name + "_sum" + braces + " " + sum + "\n";
+    *out += name + "_count" + braces + " " + std::to_string(cumulative) +
+            "\n";
+}
+
+FactoryMetrics::FactoryMetrics()
+        : produced(0), bought(0), returned(0), stolen(0), recalled(0),
+          recovered(0), handed_off(0), producers_waiting(0),
+          companies_waiting(0), returns_waiting(0), thieves_waiting(0),
+          open_to_returns(true) {}
@@ -0,0 +1,66 @@
+#ifndef FACTORY_METRICS_H_
+#define FACTORY_METRICS_H_
+
+#include <atomic>
+#include <string>
+
+/*
+ * Latency histogram with fixed buckets, from 10 microseconds to 10 seconds
+ * in powers of ten. Recording is lock-free, so it can be read while
+ * threads record into it.
+ */
+class LatencyHistogram {
+public:
+    static const int BUCKETS = 7;
+
+    LatencyHistogram();
+
+    void record(long long ns);
+
+    /*
+     * Appends the histogram as a Prometheus histogram named name, in
+     * seconds, with labels (such as class="company") if not empty.
+     */
+    void render(const std::string &name, const std::string &labels,
+                std::string *out) const;
+
+private:
+    // counts[i] counts the samples up to the i-th bound, like le does, the
+    // last one the rest
+    std::atomic<unsigned long> counts[BUCKETS + 1];
+    std::atomic<unsigned long long> sum_ns;
+};
+
+/*
+ * Counters and gauges that a factory keeps with atomics, so that they can
+ * be read without the factory lock, see Factory::renderMetrics.
+ */
+struct FactoryMetrics {
+    FactoryMetrics();
+
+    std::atomic<unsigned long> produced;
+    std::atomic<unsigned long> bought;
+    std::atomic<unsigned long> returned;
+    std::atomic<unsigned long> stolen;
+    std::atomic<unsigned long> recalled;
+    std::atomic<unsigned long> recovered;
+    // produced products that went straight to a waiting company buyer,
+    // they are also counted as produced and bought
+    std::atomic<unsigned long> handed_off;
+
+    // the visitors that are blocked in the factory right now
+    std::atomic<unsigned int> producers_waiting;
+    std::atomic<unsigned int> companies_waiting;
+    std::atomic<unsigned int> returns_waiting;
+    std::atomic<unsigned int> thieves_waiting;
+
+    // the returns service's state, the factory's own flag is not atomic
+    std::atomic<bool> open_to_returns;
+
+    // time company buyers spend in buyProducts
+    LatencyHistogram company_wait;
+    // time producers wait for space
+    LatencyHistogram producer_wait;
+};
+
+#endif // FACTORY_METRICS_H_
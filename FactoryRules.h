@@ -0,0 +1,102 @@
+#ifndef FACTORY_RULES_H_
+#define FACTORY_RULES_H_
+
+#include <cstddef>
+#include "Factory.h"
+
+/*
+ * The rules that decide which visitor may go ahead, shared by Factory and
+ * FactorySimulator so that a simulation follows the real factory.
+ * The state rules read the factory through a view with the methods
+ *   bool open()                 the factory is open to visitors
+ *   bool returnsOpen()          the returns service is open
+ *   unsigned int thieves()      thieves inside, they go first
+ *   unsigned int companies()    company buyers inside, they go before
+ *                               simple buyers
+ *   std::size_t available()     available products
+ *   std::size_t capacity()      the inventory's limit, 0 for none
+ * A rule calls only the methods it needs, in the order written, so a view
+ * over atomics can leave its busiest field for last.
+ */
+namespace FactoryRules {
+
+template<class View>
+bool thievesInside(const View &view) {
+    return FactoryFeatures::THIEVES && view.thieves() > 0;
+}
+
+template<class View>
+bool returnsClosed(const View &view) {
+    return FactoryFeatures::RETURNS && !view.returnsOpen();
+}
+
+// thieves only wait for the factory to open
+template<class View>
+bool thievesBlocked(const View &view) {
+    return !view.open();
+}
+
+template<class View>
+bool companiesBlocked(const View &view) {
+    return !view.open() || thievesInside(view);
+}
+
+template<class View>
+bool returnsBlocked(const View &view) {
+    return !view.open() || returnsClosed(view) || thievesInside(view);
+}
+
+// simple buyers do not wait, they give up when this is true
+template<class View>
+bool simpleBuyersBlocked(const View &view) {
+    return !view.open() || thievesInside(view) || view.companies() > 0 ||
+           view.available() == 0;
+}
+
+template<class View>
+bool producersBlocked(const View &view) {
+    return view.capacity() > 0 && view.available() >= view.capacity();
+}
+
+/*
+ * Returns true if order may buy at now_ns under policy, see
+ * Factory::AdmissionPolicy. Orders are iterators over the waiting orders,
+ * oldest first, with num_products and arrival_ns fields. Otherwise sets
+ * *recheck_ns to the time at which the answer may change without any
+ * order or product coming or going, or to 0 if there is none.
+ */
+template<class OrderIterator>
+bool mayBuy(Factory::AdmissionPolicy policy, long long bound_ns,
+            long long now_ns, std::size_t available, OrderIterator oldest,
+            OrderIterator order, long long *recheck_ns) {
+    *recheck_ns = 0;
+    if (available < static_cast<std::size_t>(order->num_products)) {
+        return false;
+    }
+    switch (policy) {
+        case Factory::GREEDY:
+            return true;
+        case Factory::FIFO:
+            return order == oldest;
+        case Factory::MAX_WAIT:
+            // the oldest order stays overdue until it buys
+            return oldest == order || now_ns - oldest->arrival_ns < bound_ns;
+        case Factory::AGING: {
+            long long level = (now_ns - order->arrival_ns) / bound_ns;
+            for (auto other = oldest; other != order; ++other) {
+                // orders are sorted by arrival, the rest are not older
+                if ((now_ns - other->arrival_ns) / bound_ns > level) {
+                    // this order's level may catch up with the older one's
+                    *recheck_ns = order->arrival_ns + (level + 1) * bound_ns;
+                    return false;
+                }
+            }
+            return true;
+        }
+    }
+    return true;
+}
+
+}
+
+#endif // FACTORY_RULES_H_
@@ -0,0 +1,393 @@
+#include "FactorySimulator.h"
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include "FactoryRules.h"
+
+const char FactorySimulator::PRODUCER;
+const char FactorySimulator::SIMPLE_BUYER;
+const char FactorySimulator::COMPANY_BUYER;
+const char FactorySimulator::THIEF;
+const char FactorySimulator::OPEN;
+const char FactorySimulator::CLOSE;
+const char FactorySimulator::OPEN_RETURNS;
+const char FactorySimulator::CLOSE_RETURNS;
+
+FactorySimulator::SyntheticWorkload::SyntheticWorkload()
+        : duration_ns(1000000000LL), producer_rate(0), producer_batch(1),
+          simple_buyer_rate(0), company_rate(0), max_company_order(1),
+          company_returns(0), thief_rate(0), thief_size(1), close_every_ns(0),
+          closed_ns(0), returns_close_every_ns(0), returns_closed_ns(0),
+          seed(1) {}
+
+FactorySimulator::ClassReport::ClassReport()
+        : arrivals(0), served(0), waited(0), mean_wait_ns(0), p99_wait_ns(0),
+          max_wait_ns(0), mean_queue(0), max_queue(0), waiting_at_end(0) {}
+
+bool FactorySimulator::RulesView::open() const {
+    return simulator->open_to_visitors;
+}
+
+bool FactorySimulator::RulesView::returnsOpen() const {
+    return simulator->open_to_returns;
+}
+
+unsigned int FactorySimulator::RulesView::thieves() const {
+    return simulator->thieves_inside;
+}
+
+unsigned int FactorySimulator::RulesView::companies() const {
+    // like Factory, companies waiting for a closed returns service step out
+    std::size_t returning = FactoryRules::returnsClosed(*this) ?
+                            0 : simulator->waiting_returns.size();
+    return simulator->ordering_companies + static_cast<unsigned int>(returning);
+}
+
+std::size_t FactorySimulator::RulesView::available() const {
+    return simulator->available_products;
+}
+
+std::size_t FactorySimulator::RulesView::capacity() const {
+    return simulator->capacity_limit;
+}
+
+FactorySimulator::FactorySimulator(std::size_t capacity,
+                                   Factory::AdmissionPolicy policy,
+                                   long admission_bound_ms,
+                                   std::size_t initial_products)
+        : capacity_limit(capacity), admission_policy(policy),
+          admission_bound_ns(admission_bound_ms > 0 ?
+                             admission_bound_ms * 1000000LL : 1),
+          initial_products(initial_products) {
+    reset();
+}
+
+void FactorySimulator::reset() {
+    now_ns = 0;
+    open_to_visitors = true;
+    open_to_returns = true;
+    available_products = initial_products;
+    thieves_inside = 0;
+    ordering_companies = 0;
+    waiting_producers.clear();
+    orders.clear();
+    waiting_returns.clear();
+    waiting_thieves.clear();
+    rechecks.clear();
+    producers = ClassState();
+    companies = ClassState();
+    returns = ClassState();
+    thieves = ClassState();
+    report = Report();
+}
+
+FactorySimulator::Report FactorySimulator::run(std::vector<Arrival> arrivals) {
+    reset();
+    std::stable_sort(arrivals.begin(), arrivals.end(),
+                     [](const Arrival &a, const Arrival &b) {
+                         return a.time_ns < b.time_ns;
+                     });
+    auto next = arrivals.begin();
+    while (next != arrivals.end() || !rechecks.empty()) {
+        if (!rechecks.empty() &&
+            (next == arrivals.end() || *rechecks.begin() < next->time_ns)) {
+            now_ns = std::max(now_ns, *rechecks.begin());
+            rechecks.erase(rechecks.begin());
+            settle();
+        } else {
+            now_ns = std::max(now_ns, next->time_ns);
+            arrive(*next++);
+            settle();
+        }
+        sampleQueues();
+        report.events++;
+    }
+    report.simulated_ns = now_ns;
+    finish(&producers, waiting_producers.size(), now_ns);
+    finish(&companies, orders.size(), now_ns);
+    finish(&returns, waiting_returns.size(), now_ns);
+    finish(&thieves, waiting_thieves.size(), now_ns);
+    report.producers = producers.report;
+    report.companies = companies.report;
+    report.returns = returns.report;
+    report.thieves = thieves.report;
+    report.available = available_products;
+    return report;
+}
+
+void FactorySimulator::arrive(const Arrival &arrival) {
+    RulesView view(this);
+    Waiter waiter;
+    waiter.arrival_ns = now_ns;
+    waiter.count = std::max(arrival.count, 0);
+    waiter.returns = std::min(std::max(arrival.returns, 0), waiter.count);
+    switch (arrival.kind) {
+        case PRODUCER:
+            producers.report.arrivals++;
+            queueChanging(&producers, waiting_producers.size());
+            waiting_producers.push_back(waiter);
+            break;
+        case SIMPLE_BUYER:
+            if (FactoryRules::simpleBuyersBlocked(view)) {
+                report.simple_failures++;
+            } else {
+                available_products--;
+                report.simple_buys++;
+                report.bought++;
+            }
+            break;
+        case COMPANY_BUYER: {
+            companies.report.arrivals++;
+            ordering_companies++;
+            queueChanging(&companies, orders.size());
+            Order order;
+            order.num_products = static_cast<std::size_t>(waiter.count);
+            order.arrival_ns = now_ns;
+            order.returns = waiter.returns;
+            orders.push_back(order);
+            break;
+        }
+        case THIEF:
+            if (!FactoryFeatures::THIEVES) break;
+            thieves.report.arrivals++;
+            thieves_inside++;
+            queueChanging(&thieves, waiting_thieves.size());
+            waiting_thieves.push_back(waiter);
+            break;
+        case OPEN:
+            open_to_visitors = true;
+            break;
+        case CLOSE:
+            open_to_visitors = false;
+            break;
+        case OPEN_RETURNS:
+            open_to_returns = true;
+            break;
+        case CLOSE_RETURNS:
+            open_to_returns = false;
+            break;
+    }
+}
+
+void FactorySimulator::settle() {
+    // thieves first, then the companies, which may make room for producers
+    bool progress = true;
+    while (progress) {
+        progress = serveThieves();
+        progress = serveReturns() || progress;
+        progress = serveCompanies() || progress;
+        progress = serveProducers() || progress;
+    }
+}
+
+bool FactorySimulator::serveThieves() {
+    if (waiting_thieves.empty() ||
+        FactoryRules::thievesBlocked(RulesView(this))) {
+        return false;
+    }
+    queueChanging(&thieves, waiting_thieves.size());
+    for (auto &thief : waiting_thieves) {
+        std::size_t stolen = std::min(available_products,
+                                      static_cast<std::size_t>(thief.count));
+        available_products -= stolen;
+        report.stolen += stolen;
+        served(&thieves, thief.arrival_ns);
+    }
+    thieves_inside -= static_cast<unsigned int>(waiting_thieves.size());
+    waiting_thieves.clear();
+    return true;
+}
+
+bool FactorySimulator::serveReturns() {
+    if (waiting_returns.empty() ||
+        FactoryRules::returnsBlocked(RulesView(this))) {
+        return false;
+    }
+    queueChanging(&returns, waiting_returns.size());
+    for (auto &returner : waiting_returns) {
+        available_products += returner.returns;
+        report.returned += returner.returns;
+        served(&returns, returner.arrival_ns);
+    }
+    waiting_returns.clear();
+    return true;
+}
+
+bool FactorySimulator::serveCompanies() {
+    bool progress = false;
+    auto order = orders.begin();
+    while (order != orders.end() &&
+           !FactoryRules::companiesBlocked(RulesView(this))) {
+        long long recheck_ns;
+        if (!FactoryRules::mayBuy(admission_policy, admission_bound_ns, now_ns,
+                                  available_products, orders.begin(), order,
+                                  &recheck_ns)) {
+            if (recheck_ns != 0) rechecks.insert(recheck_ns);
+            ++order;
+            continue;
+        }
+        Order bought = *order;
+        queueChanging(&companies, orders.size());
+        orders.erase(order);
+        served(&companies, bought.arrival_ns);
+        companyBought(bought);
+        progress = true;
+        // the admission rules look at the oldest order, start over
+        order = orders.begin();
+    }
+    return progress;
+}
+
+void FactorySimulator::companyBought(const Order &order) {
+    available_products -= order.num_products;
+    report.bought += order.num_products;
+    ordering_companies--;
+    if (order.returns == 0) return;
+    Waiter returner;
+    returner.arrival_ns = now_ns;
+    returner.count = order.returns;
+    returner.returns = order.returns;
+    returns.report.arrivals++;
+    queueChanging(&returns, waiting_returns.size());
+    waiting_returns.push_back(returner);
+}
+
+bool FactorySimulator::serveProducers() {
+    bool progress = false;
+    while (!waiting_producers.empty() &&
+           !FactoryRules::producersBlocked(RulesView(this))) {
+        Waiter &producer = waiting_producers.front();
+        std::size_t space = capacity_limit == 0 ?
+                            producer.count : capacity_limit - available_products;
+        std::size_t added = std::min(space,
+                                     static_cast<std::size_t>(producer.count));
+        available_products += added;
+        report.produced += added;
+        producer.count -= static_cast<int>(added);
+        progress = true;
+        if (producer.count > 0) break;
+        queueChanging(&producers, waiting_producers.size());
+        served(&producers, producer.arrival_ns);
+        waiting_producers.pop_front();
+    }
+    return progress;
+}
+
+void FactorySimulator::queueChanging(ClassState *state, std::size_t length) {
+    state->queue_area += static_cast<double>(length) *
+                         (now_ns - state->last_change_ns);
+    state->last_change_ns = now_ns;
+}
+
+void FactorySimulator::sampleQueues() {
+    // visitors that were served at the time they came never count
+    producers.max_queue = std::max(producers.max_queue,
+                                   waiting_producers.size());
+    companies.max_queue = std::max(companies.max_queue, orders.size());
+    returns.max_queue = std::max(returns.max_queue, waiting_returns.size());
+    thieves.max_queue = std::max(thieves.max_queue, waiting_thieves.size());
+}
+
+void FactorySimulator::served(ClassState *state, long long arrival_ns) {
+    long long wait_ns = now_ns - arrival_ns;
+    state->report.served++;
+    if (wait_ns > 0) state->report.waited++;
+    state->waits.push_back(wait_ns);
+}
+
+void FactorySimulator::finish(ClassState *state, std::size_t length,
+                              long long end_ns) {
+    ClassReport &report = state->report;
+    state->queue_area += static_cast<double>(length) *
+                         (end_ns - state->last_change_ns);
+    report.mean_queue = end_ns > 0 ? state->queue_area / end_ns : 0;
+    report.max_queue = state->max_queue;
+    report.waiting_at_end = length;
+    std::vector<long long> &waits = state->waits;
+    if (waits.empty()) return;
+    long double total = 0;
+    for (long long wait : waits) total += wait;
+    report.mean_wait_ns = static_cast<double>(total / waits.size());
+    auto p99 = waits.begin() + waits.size() * 99 / 100;
+    std::nth_element(waits.begin(), p99, waits.end());
+    report.p99_wait_ns = *p99;
+    report.max_wait_ns = *std::max_element(waits.begin(), waits.end());
+}
+
+std::vector<FactorySimulator::Arrival> FactorySimulator::generate(
+        const SyntheticWorkload &workload) {
+    std::vector<Arrival> arrivals;
+    std::mt19937_64 random(workload.seed);
+    auto poisson = [&](double rate, char kind, int count, int returns,
+                       bool random_count) {
+        if (rate <= 0) return;
+        std::exponential_distribution<double> gap(rate / 1e9);
+        std::uniform_int_distribution<int> size(1, std::max(count, 1));
+        for (double t = gap(random); t < workload.duration_ns;
+             t += gap(random)) {
+            Arrival arrival;
+            arrival.time_ns = static_cast<long long>(t);
+            arrival.kind = kind;
+            arrival.count = random_count ? size(random) : count;
+            arrival.returns = std::min(returns, arrival.count);
+            arrivals.push_back(arrival);
+        }
+    };
+    poisson(workload.producer_rate, PRODUCER, workload.producer_batch, 0,
+            false);
+    poisson(workload.simple_buyer_rate, SIMPLE_BUYER, 1, 0, false);
+    poisson(workload.company_rate, COMPANY_BUYER, workload.max_company_order,
+            workload.company_returns, true);
+    poisson(workload.thief_rate, THIEF, workload.thief_size, 0, false);
+    auto closures = [&](long long every_ns, long long closed_ns, char close,
+                        char open) {
+        if (every_ns <= 0) return;
+        for (long long t = every_ns; t < workload.duration_ns; t += every_ns) {
+            arrivals.push_back(Arrival{t, close, 0, 0});
+            arrivals.push_back(Arrival{t + closed_ns, open, 0, 0});
+        }
+    };
+    closures(workload.close_every_ns, workload.closed_ns, CLOSE, OPEN);
+    closures(workload.returns_close_every_ns, workload.returns_closed_ns,
+             CLOSE_RETURNS, OPEN_RETURNS);
+    std::stable_sort(arrivals.begin(), arrivals.end(),
+                     [](const Arrival &a, const Arrival &b) {
+                         return a.time_ns < b.time_ns;
+                     });
+    return arrivals;
+}
+
+bool FactorySimulator::save(const std::string &path,
+                            const std::vector<Arrival> &arrivals) {
+    std::ofstream out(path.c_str());
+    for (auto &arrival : arrivals) {
+        out << arrival.time_ns << " " << arrival.kind << " " << arrival.count
+            << " " << arrival.returns << "\n";
+    }
+    return static_cast<bool>(out);
+}
+
+bool FactorySimulator::load(const std::string &path,
+                            std::vector<Arrival> *arrivals) {
+    std::ifstream in(path.c_str());
+    if (!in) return false;
+    Arrival arrival;
+    while (in >> arrival.time_ns >> arrival.kind >> arrival.count >>
+              arrival.returns) {
+        switch (arrival.kind) {
+            case PRODUCER:
+            case SIMPLE_BUYER:
+            case COMPANY_BUYER:
+            case THIEF:
+            case OPEN:
+            case CLOSE:
+            case OPEN_RETURNS:
+            case CLOSE_RETURNS:
+                break;
+            default:
+                return false;
+        }
+        arrivals->push_back(arrival);
+    }
+    return in.eof();
+}
@@ -0,0 +1,225 @@
+#ifndef FACTORY_SIMULATOR_H_
+#define FACTORY_SIMULATOR_H_
+
+#include <cstddef>
+#include <deque>
+#include <list>
+#include <set>
+#include <string>
+#include <vector>
+#include "Factory.h"
+
+/*
+ * Single-threaded discrete-event simulation of a factory, for capacity
+ * planning. Visitors arrive at the times of a workload and are let through
+ * by the same rules as in Factory, see FactoryRules.h: thieves go first,
+ * company buyers keep simple buyers out, nobody gets in while the factory
+ * is closed, returns wait for the returns service, producers wait for
+ * space and waiting companies are admitted by the factory's admission
+ * policy. Products are only counted, and every visit takes no time, so the
+ * waits come from the rules and the stock alone, not from lock contention.
+ * Waiting visitors are served oldest first.
+ */
+class FactorySimulator {
+public:
+    // arrival kinds, the visitors use their Schedule roles
+    static const char PRODUCER = Schedule::PRODUCER;
+    static const char SIMPLE_BUYER = Schedule::SIMPLE_BUYER;
+    static const char COMPANY_BUYER = Schedule::COMPANY_BUYER;
+    static const char THIEF = Schedule::THIEF;
+    static const char OPEN = 'O';
+    static const char CLOSE = 'X';
+    static const char OPEN_RETURNS = 'R';
+    static const char CLOSE_RETURNS = 'r';
+
+    // a visitor's arrival, or a change of the factory's state
+    struct Arrival {
+        long long time_ns;
+        char kind;
+        // products to produce, buy or steal
+        int count;
+        // company buyers: how many of the bought products come back
+        int returns;
+    };
+
+    // a workload of Poisson arrivals, rates are per simulated second
+    struct SyntheticWorkload {
+        SyntheticWorkload();
+
+        long long duration_ns;
+        double producer_rate;
+        int producer_batch;
+        double simple_buyer_rate;
+        double company_rate;
+        // orders are uniform in 1..max_company_order
+        int max_company_order;
+        int company_returns;
+        double thief_rate;
+        int thief_size;
+        // the factory closes for closed_ns every close_every_ns, if not 0
+        long long close_every_ns;
+        long long closed_ns;
+        // the same for the returns service
+        long long returns_close_every_ns;
+        long long returns_closed_ns;
+        unsigned int seed;
+    };
+
+    // what one visitor class went through
+    struct ClassReport {
+        ClassReport();
+
+        unsigned long arrivals;
+        unsigned long served;
+        // served visitors that had to wait at all
+        unsigned long waited;
+        double mean_wait_ns;
+        long long p99_wait_ns;
+        long long max_wait_ns;
+        // waiting visitors, averaged over the simulated time
+        double mean_queue;
+        std::size_t max_queue;
+        // still waiting when the workload ended
+        std::size_t waiting_at_end;
+    };
+
+    struct Report {
+        unsigned long events;
+        long long simulated_ns;
+        ClassReport producers;
+        ClassReport companies;
+        // companies waiting to return products
+        ClassReport returns;
+        ClassReport thieves;
+        unsigned long simple_buys;
+        // simple buyers that found the factory blocked and left
+        unsigned long simple_failures;
+        unsigned long produced;
+        unsigned long bought;
+        unsigned long returned;
+        unsigned long stolen;
+        std::size_t available;
+    };
+
+    /*
+     * A factory that starts open with initial_products products, see
+     * Factory::setCapacity and Factory::setAdmissionPolicy.
+     */
+    explicit FactorySimulator(std::size_t capacity = 0,
+                              Factory::AdmissionPolicy policy = Factory::GREEDY,
+                              long admission_bound_ms = 0,
+                              std::size_t initial_products = 0);
+
+    // runs the workload, which need not be sorted, from the initial state
+    Report run(std::vector<Arrival> arrivals);
+
+    static std::vector<Arrival> generate(const SyntheticWorkload &workload);
+
+    // one "time_ns kind count returns" line per arrival
+    static bool save(const std::string &path,
+                     const std::vector<Arrival> &arrivals);
+
+    static bool load(const std::string &path, std::vector<Arrival> *arrivals);
+
+private:
+    struct Waiter {
+        long long arrival_ns;
+        int count;
+        // see Arrival::returns
+        int returns;
+    };
+
+    // a waiting company order, as FactoryRules::mayBuy reads it
+    struct Order {
+        std::size_t num_products;
+        long long arrival_ns;
+        int returns;
+    };
+
+    // samples and a time-weighted queue length of one visitor class
+    struct ClassState {
+        ClassState() : last_change_ns(0), queue_area(0), max_queue(0) {}
+
+        ClassReport report;
+        std::vector<long long> waits;
+        long long last_change_ns;
+        double queue_area;
+        std::size_t max_queue;
+    };
+
+    // the simulated state as FactoryRules reads it
+    class RulesView {
+    public:
+        explicit RulesView(const FactorySimulator *simulator)
+                : simulator(simulator) {}
+
+        bool open() const;
+
+        bool returnsOpen() const;
+
+        unsigned int thieves() const;
+
+        unsigned int companies() const;
+
+        std::size_t available() const;
+
+        std::size_t capacity() const;
+
+    private:
+        const FactorySimulator *simulator;
+    };
+
+    void reset();
+
+    void arrive(const Arrival &arrival);
+
+    // lets through every waiting visitor the rules allow, until none is
+    void settle();
+
+    bool serveThieves();
+
+    bool serveReturns();
+
+    bool serveCompanies();
+
+    bool serveProducers();
+
+    // called when a queue's length is about to change from length
+    void queueChanging(ClassState *state, std::size_t length);
+
+    // updates the longest queues after an event
+    void sampleQueues();
+
+    void served(ClassState *state, long long arrival_ns);
+
+    static void finish(ClassState *state, std::size_t length, long long end_ns);
+
+    // a company bought and leaves, or returns its products
+    void companyBought(const Order &order);
+
+    std::size_t capacity_limit;
+    Factory::AdmissionPolicy admission_policy;
+    long long admission_bound_ns;
+    std::size_t initial_products;
+
+    long long now_ns;
+    bool open_to_visitors;
+    bool open_to_returns;
+    std::size_t available_products;
+    unsigned int thieves_inside;
+    // ordering companies, and returning ones while the service is open
+    unsigned int ordering_companies;
+    std::deque<Waiter> waiting_producers;
+    std::list<Order> orders;
+    std::deque<Waiter> waiting_returns;
+    std::deque<Waiter> waiting_thieves;
+    // times at which an AGING order may be admitted
+    std::set<long long> rechecks;
+    ClassState producers;
+    ClassState companies;
+    ClassState returns;
+    ClassState thieves;
+    Report report;
+};
+
+#endif // FACTORY_SIMULATOR_H_
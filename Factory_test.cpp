@@ -1,5 +1,21 @@
 #include "Factory.h"
+#include "FactoryGroup.h"
+#include "FactorySimulator.h"
+#include "MetricsExporter.h"
 #include <assert.h>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <signal.h>
+#include <stdexcept>
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 int startSimpleBuyerTest(){
     Product p1(1,1);
@@ -299,6 +315,1008 @@ int listAvailableProductsTest(){
     return 0;
 }
 
+int tryBuyOneProbeTest(){
+    Product productArr[2];
+    for(int i=0 ; i<2 ; i++){
+        productArr[i] = Product(i+1, i+1);
+    }
+    Factory factory;
+    // probes of an empty factory fail before taking the lock
+    assert(factory.tryBuyOne() == -1);
+    factory.produce(2,productArr);
+    assert(factory.tryBuyOne() == 1);
+    assert(factory.tryBuyOne() == 2);
+    // the count follows the products out, so the probe fails again
+    assert(factory.tryBuyOne() == -1);
+    assert(factory.tryBuyOne() == -1);
+    factory.produce(1,productArr);
+    factory.closeFactory();
+    assert(factory.tryBuyOne() == -1);
+    factory.openFactory();
+    assert(factory.tryBuyOne() == 1);
+    assert(factory.tryBuyOne() == -1);
+    return 0;
+}
+
+int stolenLedgerTest(){
+    Product productArr[5];
+    for(int i=0 ; i<5 ; i++){
+        productArr[i] = Product(i+1, 10*(i+1));
+    }
+    Factory factory;
+    factory.produce(5,productArr);
+    factory.startThief(2,30);
+    assert(factory.finishThief(30) == 2);
+    factory.startThief(2,31);
+    assert(factory.finishThief(31) == 2);
+    factory.startThief(1,30);
+    assert(factory.finishThief(30) == 1);
+    StolenLedger::ThiefTotals totals = factory.stolenTotals(30);
+    assert(totals.count == 3);
+    assert(totals.value == 10 + 20 + 50);
+    totals = factory.stolenTotals(31);
+    assert(totals.count == 2);
+    assert(totals.value == 30 + 40);
+    assert(factory.stolenTotals(32).count == 0);
+    int next_id = 1;
+    factory.forEachStolenProduct([&next_id](int id, int value, int fake_id){
+        assert(id == next_id);
+        assert(value == 10*id);
+        assert(fake_id == (id <= 2 || id == 5 ? 30 : 31));
+        next_id++;
+    });
+    assert(next_id == 6);
+    assert(factory.listStolenProducts().size() == 5);
+    return 0;
+}
+
+int persistentRestartTest(){
+    char dir[] = "/tmp/factory_storeXXXXXX";
+    assert(mkdtemp(dir) != nullptr);
+    std::string path = std::string(dir) + "/factory";
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if(pid == 0){
+        // the child dies without running any destructor
+        Factory factory(path);
+        Product productArr[3000];
+        for(int i=0 ; i<3000 ; i++){
+            productArr[i] = Product(i+1, i % 7);
+        }
+        factory.produce(3000,productArr);
+        for(int i=0 ; i<1000 ; i++){
+            assert(factory.tryBuyOne() == i+1);
+        }
+        factory.startThief(500,40);
+        assert(factory.finishThief(40) == 500);
+        factory.closeReturningService();
+        factory.closeFactory();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    Factory factory(path);
+    std::list<Product> avlList = factory.listAvailableProducts();
+    assert(avlList.size() == 1500);
+    assert(avlList.front().getId() == 1501);
+    assert(avlList.back().getId() == 3000);
+    assert(factory.stolenTotals(40).count == 500);
+    assert(factory.listStolenProducts().front().first.getId() == 1001);
+    // the factory was closed when the child died
+    assert(factory.tryBuyOne() == -1);
+    factory.openFactory();
+    factory.openReturningService();
+    assert(factory.tryBuyOne() == 1501);
+    factory.checkpoint();
+    unlink(path.c_str());
+    unlink((path + ".available").c_str());
+    unlink((path + ".stolen").c_str());
+    unlink((path + ".recovered").c_str());
+    rmdir(dir);
+    return 0;
+}
+
+int persistentFailureTest(){
+    char dir[] = "/tmp/factory_storeXXXXXX";
+    assert(mkdtemp(dir) != nullptr);
+    std::string path = std::string(dir) + "/factory";
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if(pid == 0){
+        // the files can not grow past their first 64 KB
+        signal(SIGXFSZ, SIG_IGN);
+        struct rlimit limit = {1 << 16, 1 << 16};
+        Factory factory(path);
+        setrlimit(RLIMIT_FSIZE, &limit);
+        Product productArr[10000];
+        for(int i=0 ; i<10000 ; i++){
+            productArr[i] = Product(i+1, i);
+        }
+        factory.produce(10000,productArr);
+        bool thrown = false;
+        try {
+            factory.checkpoint();
+        } catch (const std::runtime_error &) {
+            thrown = true;
+        }
+        assert(thrown);
+        // the lock was released, the factory keeps working
+        assert(factory.tryBuyOne() == 1);
+        factory.startThief(10,1);
+        assert(factory.finishThief(1) == 10);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    // the store kept the products written before the failure
+    Factory factory(path);
+    assert(factory.listAvailableProducts().size() == 8192);
+    assert(factory.tryBuyOne() == 1);
+    unlink(path.c_str());
+    unlink((path + ".available").c_str());
+    unlink((path + ".stolen").c_str());
+    unlink((path + ".recovered").c_str());
+    rmdir(dir);
+    return 0;
+}
+
+int eventLogReplayTest(){
+    char path[] = "/tmp/factory_logXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    Product productArr[100];
+    for(int i=0 ; i<100 ; i++){
+        productArr[i] = Product(i+1, i);
+    }
+    Factory factory;
+    factory.enableEventLog(path, EventLog::SYNC_EVERY_BATCH);
+    factory.startProduction(100,productArr,1);
+    factory.finishProduction(1);
+    assert(factory.tryBuyOne() == 1);
+    factory.startCompanyBuyer(10,5,2);
+    assert(factory.finishCompanyBuyer(2) == 4);
+    factory.startThief(7,50);
+    assert(factory.finishThief(50) == 7);
+    factory.flushEventLog();
+    std::list<Product> available;
+    std::list<std::pair<Product, int>> stolen;
+    // 100 produced, 1 + 10 bought, 4 returned, 7 stolen
+    assert(EventLog::replay(path, &available, &stolen) == 122);
+    std::list<Product> avlList = factory.listAvailableProducts();
+    assert(available.size() == avlList.size());
+    auto expected = avlList.begin();
+    for(auto &product : available){
+        assert(product.getId() == expected->getId());
+        ++expected;
+    }
+    assert(stolen.size() == 7);
+    assert(stolen.front().second == 50);
+    unlink(path);
+    return 0;
+}
+
+/*
+ * Runs producers, company buyers, simple buyers and thieves concurrently and
+ * returns what each of them got, so two runs can be compared.
+ */
+std::vector<int> runScheduledVisitors(Factory &factory){
+    static Product productArr[20][20];
+    int id = 1;
+    for(int i=0 ; i<20 ; i++){
+        for(int j=0 ; j<20 ; j++){
+            productArr[i][j] = Product(id++, j);
+        }
+    }
+    for(int i=0 ; i<20 ; i++){
+        factory.startProduction(20,productArr[i],i);
+        factory.startCompanyBuyer(3+i%5,10,100+i);
+        factory.startSimpleBuyer(200+i);
+        factory.startThief(1+i%3,300+i);
+    }
+    std::vector<int> results;
+    for(int i=0 ; i<20 ; i++){
+        factory.finishProduction(i);
+        results.push_back(factory.finishCompanyBuyer(100+i));
+        results.push_back(factory.finishSimpleBuyer(200+i));
+        results.push_back(factory.finishThief(300+i));
+    }
+    for(auto &product : factory.listAvailableProducts()){
+        results.push_back(product.getId());
+    }
+    for(auto &stolen : factory.listStolenProducts()){
+        results.push_back(stolen.first.getId());
+        results.push_back(stolen.second);
+    }
+    return results;
+}
+
+int scheduleReplayTest(){
+    for(int run=0 ; run<5 ; run++){
+        Factory recorded;
+        recorded.recordSchedule();
+        std::vector<int> expected = runScheduledVisitors(recorded);
+        std::vector<Schedule::Event> events = recorded.stopSchedule();
+        assert(!events.empty());
+        Factory replayed;
+        replayed.replaySchedule(events);
+        assert(runScheduledVisitors(replayed) == expected);
+        replayed.stopSchedule();
+    }
+    return 0;
+}
+
+int lockPoliciesTest(){
+    const FactoryLock::Policy policies[] = {
+            FactoryLock::PTHREAD_MUTEX, FactoryLock::SPIN_THEN_PARK,
+            FactoryLock::TICKET, FactoryLock::MCS};
+    for(auto policy : policies){
+        Factory factory(policy);
+        std::vector<int> results = runScheduledVisitors(factory);
+        // 400 products, each one is available, bought or stolen exactly once
+        std::list<Product> avlList = factory.listAvailableProducts();
+        std::list<std::pair<Product, int>> stoList =
+                factory.listStolenProducts();
+        std::vector<bool> seen(401);
+        for(auto &product : avlList){
+            assert(!seen[product.getId()]);
+            seen[product.getId()] = true;
+        }
+        for(auto &stolen : stoList){
+            assert(!seen[stolen.first.getId()]);
+            seen[stolen.first.getId()] = true;
+        }
+    }
+    return 0;
+}
+
+int tryBuyManyTest(){
+    Product productArr[5];
+    for(int i=0 ; i<5 ; i++){
+        productArr[i] = Product(i+1, i+1);
+    }
+    Factory factory;
+    int results[8];
+    assert(factory.tryBuyMany(3,results) == 0);
+    assert(results[0] == -1 && results[2] == -1);
+    factory.produce(5,productArr);
+    assert(factory.tryBuyMany(3,results) == 3);
+    assert(results[0] == 1 && results[1] == 2 && results[2] == 3);
+    factory.closeFactory();
+    assert(factory.tryBuyMany(2,results) == 0);
+    factory.openFactory();
+    assert(factory.tryBuyMany(4,results) == 2);
+    assert(results[0] == 4 && results[1] == 5);
+    assert(results[2] == -1 && results[3] == -1);
+    return 0;
+}
+
+int capacityTest(){
+    Product productArr[6];
+    for(int i=0 ; i<6 ; i++){
+        productArr[i] = Product(i+1, i+1);
+    }
+    Factory factory;
+    factory.setCapacity(2);
+    assert(!factory.tryProduce(3,productArr));
+    assert(factory.tryProduce(2,productArr));
+    assert(factory.produceFor(1,productArr+2,20) == 0);
+    // the producer blocks after adding nothing, until buyers make space
+    factory.startProduction(4,productArr+2,1);
+    for(int expected=1 ; expected<=6 ; expected++){
+        int id;
+        while((id = factory.tryBuyOne()) == -1){
+            usleep(1000);
+        }
+        assert(id == expected);
+    }
+    factory.finishProduction(1);
+    FactoryStats stats = factory.getStats();
+    assert(stats.available_products == 0);
+    assert(stats.capacity == 2);
+    assert(stats.low_watermark == 1);
+    assert(stats.peak_available == 2);
+    assert(stats.producers_waiting == 0);
+    assert(stats.producer_waits > 0);
+    return 0;
+}
+
+int admissionTest(){
+    Product productArr[4];
+    for(int i=0 ; i<4 ; i++){
+        productArr[i] = Product(i+1, i+1);
+    }
+    const Factory::AdmissionPolicy policies[] = {
+            Factory::GREEDY, Factory::FIFO, Factory::AGING, Factory::MAX_WAIT};
+    for(auto policy : policies){
+        Factory factory;
+        factory.setAdmissionPolicy(policy,10);
+        // a large order, then a small one once the large one is old
+        factory.startCompanyBuyer(3,0,1);
+        usleep(30000);
+        factory.startCompanyBuyer(1,0,2);
+        usleep(10000);
+        factory.produce(1,productArr);
+        usleep(30000);
+        // only the greedy policy lets the small order jump the queue
+        assert(factory.listAvailableProducts().size() ==
+               (policy == Factory::GREEDY ? 0 : 1));
+        factory.produce(3,productArr+1);
+        assert(factory.finishCompanyBuyer(1) == 0);
+        assert(factory.finishCompanyBuyer(2) == 0);
+        assert(factory.listAvailableProducts().empty());
+    }
+    return 0;
+}
+
+int reservationTest(){
+    Product productArr[4];
+    for(int i=0 ; i<4 ; i++){
+        productArr[i] = Product(i+1, i+1);
+    }
+    Factory factory;
+    factory.setReservations(true);
+    factory.startCompanyBuyer(3,0,1);
+    usleep(20000);
+    factory.produce(2,productArr);
+    // the company claimed both, so there is nothing left to steal
+    assert(factory.listAvailableProducts().empty());
+    assert(factory.getStats().reserved_products == 2);
+    factory.startThief(5,7);
+    assert(factory.finishThief(7) == 0);
+    factory.produce(2,productArr+2);
+    assert(factory.finishCompanyBuyer(1) == 0);
+    std::list<Product> left = factory.listAvailableProducts();
+    assert(left.size() == 1 && left.front().getId() == 4);
+    assert(factory.getStats().reserved_products == 0);
+    return 0;
+}
+
+int reservationQueueTest(){
+    Product productArr[7];
+    for(int i=0 ; i<7 ; i++){
+        productArr[i] = Product(i+1, i+1);
+    }
+    Factory factory;
+    factory.setAdmissionPolicy(Factory::FIFO);
+    factory.setReservations(true);
+    factory.startCompanyBuyer(5,0,1);
+    usleep(20000);
+    // queued behind the reserving order, which is oldest until it leaves
+    factory.setReservations(false);
+    factory.startCompanyBuyer(2,0,2);
+    usleep(20000);
+    factory.produce(7,productArr);
+    assert(factory.finishCompanyBuyer(1) == 0);
+    usleep(50000);
+    // the reserving order woke the queue when it left
+    assert(factory.listAvailableProducts().empty());
+    assert(factory.finishCompanyBuyer(2) == 0);
+    return 0;
+}
+
+int numaTopologyTest(){
+    std::vector<int> cpus;
+    assert(NumaTopology::parseCpuList("0-2,5,7-8\n",&cpus));
+    assert(cpus == std::vector<int>({0,1,2,5,7,8}));
+    cpus.clear();
+    assert(!NumaTopology::parseCpuList("3-1",&cpus));
+    // a fake two node machine, with a directory that is not a node
+    std::string root = "/tmp/factory_test_numa";
+    system(("rm -rf " + root + " && mkdir -p " + root + "/node0 " + root +
+            "/node1 " + root + "/power").c_str());
+    std::ofstream(root + "/node0/cpulist") << "0-1\n";
+    std::ofstream(root + "/node1/cpulist") << "2,3\n";
+    NumaTopology topology(root);
+    assert(topology.nodeCount() == 2);
+    assert(topology.cpusOf(1) == std::vector<int>({2,3}));
+    assert(topology.nodeOfCpu(1) == 0 && topology.nodeOfCpu(3) == 1);
+    assert(topology.nodeOfCpu(4) == -1);
+    // without sysfs there is one node with the CPUs we may run on
+    NumaTopology missing(root + "/missing");
+    assert(missing.nodeCount() == 1 && !missing.cpusOf(0).empty());
+    system(("rm -rf " + root).c_str());
+
+    Product productArr[4];
+    for(int i=0 ; i<4 ; i++){
+        productArr[i] = Product(i+1, i+1);
+    }
+    Factory factory;
+    factory.setThreadPlacement(true);
+    factory.startProduction(4,productArr,1);
+    factory.finishProduction(1);
+    factory.startCompanyBuyer(2,0,1);
+    factory.startSimpleBuyer(1);
+    factory.finishCompanyBuyer(1);
+    factory.finishSimpleBuyer(1);
+    factory.startThief(4,1);
+    factory.finishThief(1);
+    assert(factory.listAvailableProducts().empty());
+    return 0;
+}
+
+int factoryGroupTest(){
+    Product productArr[6];
+    for(int i=0 ; i<6 ; i++){
+        productArr[i] = Product(i+1, i+1);
+    }
+    FactoryGroup group(3,2);
+    group.factory(1).produce(6,productArr);
+    assert(group.route(2) == 1);
+    assert(group.rebalance() == 4);
+    for(std::size_t i=0 ; i<3 ; i++){
+        assert(group.factory(i).availableCount() == 2);
+    }
+    std::atomic<int> kept(0);
+    // values below 2 go back, so the group keeps 3 of the 4 products
+    for(int i=0 ; i<2 ; i++){
+        group.submitCompanyOrder(2,2,[&kept](std::size_t, int returned){
+            kept += 2 - returned;
+        });
+        group.waitIdle();
+    }
+    assert(kept == 3);
+    FactoryGroupStats stats = group.getStats();
+    assert(stats.factories == 3 && stats.orders_routed == 2);
+    assert(stats.products_rebalanced == 4 && stats.queued_tasks == 0);
+    assert(stats.totals.available_products == 3);
+
+    // a full factory gets what fits, the rest stays in order at the source
+    FactoryGroup bounded(3,1);
+    bounded.factory(0).produce(6,productArr);
+    bounded.factory(1).setCapacity(1);
+    assert(bounded.rebalance() == 3);
+    std::list<Product> avlList = bounded.factory(0).listAvailableProducts();
+    assert(avlList.size() == 3 && avlList.front().getId() == 4);
+    assert(bounded.factory(1).listAvailableProducts().front().getId() == 1);
+    assert(bounded.factory(2).listAvailableProducts().front().getId() == 2);
+
+    // the staged products count in the totals
+    FactoryGroup staged(2,1);
+    staged.factory(0).setStaging(100,100000);
+    staged.factory(1).setStaging(100,100000);
+    staged.factory(0).produce(2,productArr);
+    staged.factory(1).produce(3,productArr+2);
+    assert(staged.getStats().totals.staged_products == 5);
+
+    // and so do the products handed straight to the group's orders
+    FactoryGroup handed(1,1);
+    handed.submitCompanyOrder(2,0);
+    usleep(20000);
+    handed.factory(0).produce(2,productArr);
+    handed.waitIdle();
+    assert(handed.getStats().totals.handed_off == 2);
+
+    // the group's buyers are visitors of their factory
+    FactoryGroup counted(1,1);
+    counted.submitCompanyOrder(5,0);
+    usleep(20000);
+    assert(counted.factory(0).shutdown(0).cancelled == 1);
+    counted.waitIdle();
+
+    // destroying a group cuts the wait of an order no factory can fill
+    {
+        FactoryGroup parked(2,1);
+        parked.submitCompanyOrder(5,0);
+        usleep(20000);
+    }
+
+    // the orders queued behind it are refused, the other tasks still run
+    std::atomic<int> refused(0);
+    bool ran = false;
+    {
+        FactoryGroup queued(1,1);
+        queued.factory(0).produce(1,productArr);
+        queued.submitCompanyOrder(5,0);
+        usleep(20000);
+        // a buyer that got in would send its product back
+        queued.submitCompanyOrder(1,100,[&refused](std::size_t, int returned){
+            if(returned == 0) refused++;
+        });
+        queued.submit([&ran](){ ran = true; });
+        assert(queued.getStats().queued_tasks == 2);
+    }
+    assert(refused == 1 && ran);
+    return 0;
+}
+
+int drainShutdownTest(){
+    Product productArr[4];
+    for(int i=0 ; i<4 ; i++){
+        productArr[i] = Product(i+1, i+1);
+    }
+    Factory drained;
+    drained.produce(2,productArr);
+    drained.startCompanyBuyer(1,0,1);
+    drained.startSimpleBuyer(1);
+    assert(drained.drain() == 2);
+    drained.startProduction(2,productArr+2,1);
+    drained.finishProduction(1);
+    assert(drained.finishSimpleBuyer(1) == -1);
+    assert(drained.listAvailableProducts().size() <= 1);
+
+    Factory factory;
+    factory.setCapacity(2);
+    factory.produce(2,productArr);
+    // a company waiting for the returns service, a producer waiting for
+    // space and a company waiting for products
+    factory.closeReturningService();
+    factory.startCompanyBuyer(1,100,2);
+    usleep(20000);
+    factory.produce(1,productArr+2);
+    factory.startProduction(1,productArr+3,1);
+    factory.startCompanyBuyer(5,0,1);
+    usleep(20000);
+    ShutdownStatus status = factory.shutdown(10);
+    assert(status.joined == 3 && status.cancelled == 3);
+    assert(factory.finishCompanyBuyer(1) == 0);
+    assert(factory.finishCompanyBuyer(2) == 0);
+    factory.startSimpleBuyer(1);
+    assert(factory.finishSimpleBuyer(1) == -1);
+    // the returned product was taken back, the producer's was dropped
+    std::list<Product> left = factory.listAvailableProducts();
+    assert(left.size() == 3 && left.front().getId() == 2);
+    assert(left.back().getId() == 1);
+    return 0;
+}
+
+int stagingTest(){
+    Product productArr[8];
+    for(int i=0 ; i<8 ; i++){
+        productArr[i] = Product(i+1, i+1);
+    }
+    Factory factory;
+    factory.setStaging(3,100000);
+    factory.produce(2,productArr);
+    assert(factory.listAvailableProducts().empty());
+    assert(factory.getStats().staged_products == 2);
+    // a starved buyer pulls the staged products
+    assert(factory.tryBuyOne() == 1);
+    assert(factory.getStats().staged_products == 0);
+    // a full buffer is published in order
+    factory.produce(3,productArr+2);
+    std::list<Product> available = factory.listAvailableProducts();
+    assert(available.size() == 4 && available.back().getId() == 5);
+    factory.produce(2,productArr+5);
+    assert(factory.listAvailableProducts().size() == 4);
+    // a company takes the staged products too
+    factory.startCompanyBuyer(6,0,1);
+    assert(factory.finishCompanyBuyer(1) == 0);
+    assert(factory.listAvailableProducts().empty());
+    factory.produce(1,productArr+7);
+    factory.setStaging(0,0);
+    assert(factory.listAvailableProducts().size() == 1);
+
+    // thieves come first, they steal the staged products too
+    factory.setStaging(100,100000);
+    factory.produce(5,productArr);
+    factory.startThief(6,1);
+    assert(factory.finishThief(1) == 6);
+    assert(factory.tryBuyOne() == -1);
+
+    // the next buyer publishes the buffer of a producer that went idle
+    factory.setStaging(0,0);
+    factory.produce(1,productArr);
+    factory.setStaging(100,1);
+    factory.produce(3,productArr+1);
+    usleep(20000);
+    assert(factory.getStats().staged_products == 3);
+    assert(factory.tryBuyOne() == 1);
+    assert(factory.getStats().staged_products == 0);
+    available = factory.listAvailableProducts();
+    assert(available.size() == 3 && available.front().getId() == 2);
+
+    // a producer thread publishes its buffer when it finishes
+    factory.setStaging(100,100000);
+    factory.startProduction(2,productArr+4,1);
+    factory.finishProduction(1);
+    assert(factory.getStats().staged_products == 0);
+    assert(factory.listAvailableProducts().size() == 5);
+    return 0;
+}
+
+int metricsExporterTest(){
+    Product productArr[3];
+    for(int i=0 ; i<3 ; i++){
+        productArr[i] = Product(i+1, i+1);
+    }
+    Factory factory;
+    factory.produce(3,productArr);
+    assert(factory.tryBuyOne() == 1);
+    std::string metrics;
+    factory.renderMetrics(&metrics);
+    assert(metrics.find("factory_available_products 2\n") != std::string::npos);
+    assert(metrics.find("factory_products_total{event=\"bought\"} 1\n") != std::string::npos);
+    // a sample on a bound counts in that bound's bucket
+    LatencyHistogram histogram;
+    histogram.record(10000);
+    histogram.record(10001);
+    std::string rendered;
+    histogram.render("wait_seconds", "", &rendered);
+    assert(rendered.find("wait_seconds_bucket{le=\"1e-05\"} 1\n") != std::string::npos);
+    assert(rendered.find("wait_seconds_bucket{le=\"0.0001\"} 2\n") != std::string::npos);
+    const char *path = "/tmp/factory_test_metrics.sock";
+    MetricsExporter exporter(factory, std::string(path));
+    assert(exporter.listening());
+    int client = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    assert(connect(client, (struct sockaddr *)&address, sizeof(address)) == 0);
+    const char *request = "GET /metrics HTTP/1.0\r\n\r\n";
+    assert(write(client, request, strlen(request)) == (ssize_t)strlen(request));
+    std::string response;
+    char buffer[4096];
+    ssize_t received;
+    while((received = read(client, buffer, sizeof(buffer))) > 0){
+        response.append(buffer, received);
+    }
+    close(client);
+    assert(response.find("HTTP/1.0 200 OK") == 0);
+    assert(response.find("factory_products_total{event=\"produced\"} 3\n") != std::string::npos);
+    assert(response.find("factory_waiters{class=\"company\"} 0\n") != std::string::npos);
+    return 0;
+}
+
+int productIndexTest(){
+    // ids repeat and collide, the index must still find every node
+    std::list<Product> products;
+    ProductIndex index;
+    for(int i=0 ; i<5000 ; i++){
+        products.push_back(Product(i % 1000, i));
+        index.insert(i % 1000, std::prev(products.end()));
+    }
+    for(auto i = products.begin() ; i != products.end() ;){
+        if(i->getValue() % 3 == 0){
+            index.erase(i->getId(), i);
+            i = products.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    assert(index.size() == products.size());
+    for(auto i = products.begin() ; i != products.end() ; ++i){
+        ProductIndex::Position found;
+        assert(index.find(i->getId(), &found) && found->getId() == i->getId());
+    }
+    for(auto i = products.begin() ; i != products.end() ; ++i){
+        index.erase(i->getId(), i);
+    }
+    ProductIndex::Position found;
+    assert(index.size() == 0 && !index.find(7, &found));
+    return 0;
+}
+
+int recallTest(){
+    char dir[] = "/tmp/factory_recallXXXXXX";
+    assert(mkdtemp(dir) != nullptr);
+    std::string path = std::string(dir) + "/factory";
+    std::string log_path = std::string(dir) + "/log";
+    Product productArr[2000];
+    for(int i=0 ; i<2000 ; i++){
+        productArr[i] = Product(i+1, i % 5);
+    }
+    {
+        Factory factory(path);
+        factory.enableEventLog(log_path, EventLog::SYNC_EVERY_BATCH);
+        factory.produce(2000,productArr);
+        assert(factory.tryBuyOne() == 1);
+        factory.startThief(2,7);
+        assert(factory.finishThief(7) == 2);
+        // the company returns product 4, which is indexed again
+        assert(factory.runCompanyBuyer(1,1000,3) == 1);
+        std::vector<int> ids = {500, 2, 4, 3, 500, 1, 1999, 4000, 1500};
+        RecallReport report = factory.recallProducts(ids);
+        assert(report.recalled.size() == 4);
+        assert(report.recalled.front().getId() == 500);
+        assert(report.stolen.size() == 2 && report.stolen[0] == 2);
+        assert(report.stolen[1] == 3);
+        assert(report.sold.size() == 2 && report.sold[0] == 1);
+        assert(report.sold[1] == 4000);
+        std::list<Product> avlList = factory.listAvailableProducts();
+        assert(avlList.size() == 1993);
+        for(auto &product : avlList){
+            assert(product.getId() != 500 && product.getId() != 4);
+        }
+        // the rest is still bought in order
+        assert(factory.tryBuyOne() == 5);
+        assert(factory.recallProducts(ids).recalled.empty());
+        factory.flushEventLog();
+        std::list<Product> available;
+        std::list<std::pair<Product, int>> stolen;
+        assert(EventLog::replay(log_path, &available, &stolen) > 0);
+        assert(available.size() == 1992 && available.front().getId() == 6);
+    }
+    // the store lost the recalled products too
+    Factory factory(path);
+    std::list<Product> avlList = factory.listAvailableProducts();
+    assert(avlList.size() == 1992 && avlList.front().getId() == 6);
+    assert(factory.recallProducts({1000}).recalled.size() == 1);
+    assert(factory.tryBuyOne() == 6);
+    unlink(path.c_str());
+    unlink((path + ".available").c_str());
+    unlink((path + ".stolen").c_str());
+    unlink((path + ".recovered").c_str());
+    unlink(log_path.c_str());
+    rmdir(dir);
+    return 0;
+}
+
+int recoverStolenTest(){
+    char dir[] = "/tmp/factory_recoverXXXXXX";
+    assert(mkdtemp(dir) != nullptr);
+    std::string path = std::string(dir) + "/factory";
+    std::string log_path = std::string(dir) + "/log";
+    Product productArr[20];
+    for(int i=0 ; i<20 ; i++){
+        productArr[i] = Product(i+1, i+1);
+    }
+    {
+        Factory factory(path);
+        factory.enableEventLog(log_path, EventLog::SYNC_EVERY_BATCH);
+        factory.produce(20,productArr);
+        factory.startThief(5,1);
+        assert(factory.finishThief(1) == 5);
+        factory.startThief(3,2);
+        assert(factory.finishThief(2) == 3);
+        factory.startThief(2,1);
+        assert(factory.finishThief(1) == 2);
+        assert(factory.recoverStolen(3) == 0);
+        // a company waiting for more than the inventory buys the recovered
+        factory.startCompanyBuyer(15,0,9);
+        assert(factory.recoverStolen(1) == 7);
+        assert(factory.finishCompanyBuyer(9) == 0);
+        std::list<Product> avlList = factory.listAvailableProducts();
+        // 10 left, 7 recovered (ids 1-5, 9, 10), 15 bought
+        assert(avlList.size() == 2);
+        assert(avlList.front().getId() == 9 && avlList.back().getId() == 10);
+        assert(factory.stolenTotals(1).count == 0);
+        assert(factory.stolenTotals(2).count == 3);
+        std::list<std::pair<Product, int>> stoList = factory.listStolenProducts();
+        assert(stoList.size() == 3 && stoList.front().first.getId() == 6);
+        assert(factory.getStats().stolen_products == 3);
+        factory.flushEventLog();
+        std::list<Product> available;
+        std::list<std::pair<Product, int>> stolen;
+        assert(EventLog::replay(log_path, &available, &stolen) > 0);
+        assert(available.size() == 2 && available.front().getId() == 9);
+        assert(stolen.size() == 3 && stolen.back().second == 2);
+    }
+    // the store remembers which stolen products were recovered
+    Factory factory(path);
+    assert(factory.listAvailableProducts().size() == 2);
+    assert(factory.listStolenProducts().size() == 3);
+    assert(factory.recoverStolen(1) == 0);
+    assert(factory.recoverAllStolen() == 3);
+    assert(factory.listStolenProducts().empty());
+    std::list<Product> avlList = factory.listAvailableProducts();
+    assert(avlList.size() == 5 && avlList.back().getId() == 8);
+    unlink(path.c_str());
+    unlink((path + ".available").c_str());
+    unlink((path + ".stolen").c_str());
+    unlink((path + ".recovered").c_str());
+    unlink(log_path.c_str());
+    rmdir(dir);
+    return 0;
+}
+
+int fileProductionTest(){
+    char path[] = "/tmp/factory_productsXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    // 200000 records span several chunks, and a torn record at the end
+    std::vector<int32_t> records;
+    for(int i=0 ; i<200000 ; i++){
+        records.push_back(i+1);
+        records.push_back(i % 9);
+    }
+    records.push_back(7);
+    size_t bytes = records.size() * sizeof(int32_t) - 2;
+    assert(write(fd, records.data(), bytes) == (ssize_t)bytes);
+    close(fd);
+    {
+        Factory factory;
+        assert(factory.produceFromFile(path) == 200000);
+        std::list<Product> avlList = factory.listAvailableProducts();
+        assert(avlList.size() == 200000);
+        assert(avlList.front().getId() == 1 && avlList.back().getId() == 200000);
+        assert(avlList.back().getValue() == 199999 % 9);
+    }
+    {
+        // a bounded inventory makes the producer wait for the buyer
+        Factory factory;
+        factory.setCapacity(1000);
+        factory.startFileProduction(path, 3);
+        int bought = 0, expected = 1;
+        int results[256];
+        while(bought < 200000){
+            int count = factory.tryBuyMany(256, results);
+            for(int i=0 ; i<count ; i++){
+                assert(results[i] == expected++);
+            }
+            bought += count;
+            assert(factory.getStats().available_products <= 1000);
+        }
+        factory.finishProduction(3);
+        assert(factory.getStats().producer_waits > 0);
+    }
+    Factory factory;
+    assert(factory.produceFromFile("/tmp/factory_no_such_file") == -1);
+    unlink(path);
+    return 0;
+}
+
+int simulatorTest(){
+    typedef FactorySimulator::Arrival Arrival;
+    // thieves go first, then companies, and simple buyers do not wait
+    std::vector<Arrival> arrivals = {
+            {0, FactorySimulator::CLOSE, 0, 0},
+            {1, FactorySimulator::PRODUCER, 10, 0},
+            {2, FactorySimulator::COMPANY_BUYER, 5, 2},
+            {3, FactorySimulator::THIEF, 4, 0},
+            {4, FactorySimulator::SIMPLE_BUYER, 1, 0},
+            {5, FactorySimulator::CLOSE_RETURNS, 0, 0},
+            {10, FactorySimulator::OPEN, 0, 0},
+            {11, FactorySimulator::SIMPLE_BUYER, 1, 0},
+            {20, FactorySimulator::OPEN_RETURNS, 0, 0}};
+    FactorySimulator simulator;
+    FactorySimulator::Report report = simulator.run(arrivals);
+    assert(report.events == 9);
+    assert(report.stolen == 4 && report.bought == 6);
+    assert(report.thieves.served == 1 && report.thieves.max_wait_ns == 7);
+    assert(report.companies.served == 1 && report.companies.max_wait_ns == 8);
+    // the company waited for the returns service outside, so a simple
+    // buyer got the last product
+    assert(report.simple_buys == 1 && report.simple_failures == 1);
+    assert(report.returns.served == 1 && report.returns.max_wait_ns == 10);
+    assert(report.returned == 2 && report.available == 2);
+    // FIFO keeps the products for the large order, GREEDY sells them
+    std::vector<Arrival> orders = {
+            {0, FactorySimulator::COMPANY_BUYER, 10, 0},
+            {1, FactorySimulator::COMPANY_BUYER, 1, 0},
+            {2, FactorySimulator::PRODUCER, 5, 0}};
+    report = FactorySimulator(0, Factory::FIFO).run(orders);
+    assert(report.companies.served == 0 && report.companies.waiting_at_end == 2);
+    report = FactorySimulator(0, Factory::GREEDY).run(orders);
+    assert(report.companies.served == 1 && report.available == 4);
+    // a full inventory holds producers back
+    std::vector<Arrival> bounded = {
+            {0, FactorySimulator::PRODUCER, 8, 0},
+            {5, FactorySimulator::COMPANY_BUYER, 3, 0}};
+    report = FactorySimulator(5).run(bounded);
+    assert(report.producers.served == 1 && report.producers.max_wait_ns == 5);
+    assert(report.produced == 8 && report.available == 5);
+    // a saved workload replays the same
+    FactorySimulator::SyntheticWorkload workload;
+    workload.producer_rate = 1000;
+    workload.producer_batch = 4;
+    workload.simple_buyer_rate = 2000;
+    workload.company_rate = 300;
+    workload.max_company_order = 8;
+    workload.company_returns = 1;
+    workload.thief_rate = 10;
+    workload.thief_size = 5;
+    workload.close_every_ns = 100000000;
+    workload.closed_ns = 10000000;
+    workload.returns_close_every_ns = 70000000;
+    workload.returns_closed_ns = 20000000;
+    std::vector<Arrival> synthetic = FactorySimulator::generate(workload);
+    assert(synthetic.size() > 3000);
+    char path[] = "/tmp/factory_workloadXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    assert(FactorySimulator::save(path, synthetic));
+    std::vector<Arrival> loaded;
+    assert(FactorySimulator::load(path, &loaded));
+    unlink(path);
+    FactorySimulator aging(100, Factory::AGING, 5);
+    FactorySimulator::Report first = aging.run(synthetic);
+    FactorySimulator::Report second = aging.run(loaded);
+    assert(first.events >= synthetic.size() && first.events == second.events);
+    assert(first.bought == second.bought && first.available == second.available);
+    assert(first.produced + first.returned ==
+           first.bought + first.stolen + first.available);
+    assert(first.companies.served > 0 && first.simple_failures > 0);
+    return 0;
+}
+
+int handoffTest(){
+    char path[] = "/tmp/factory_handoffXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    Product productArr[9];
+    for(int i=0 ; i<9 ; i++){
+        productArr[i] = Product(i+1, i+1);
+    }
+    Factory factory;
+    factory.enableEventLog(path, EventLog::SYNC_EVERY_BATCH);
+    factory.produce(2,productArr);
+    factory.startCompanyBuyer(5,0,1);
+    usleep(20000);
+    // the order gets products 1 and 2, then 3 to 5 straight from produce
+    factory.produce(4,productArr+2);
+    assert(factory.getStats().handed_off == 3);
+    std::list<Product> avlList = factory.listAvailableProducts();
+    assert(avlList.size() == 1 && avlList.front().getId() == 6);
+    assert(factory.finishCompanyBuyer(1) == 0);
+    std::string text;
+    factory.renderMetrics(&text);
+    assert(text.find("factory_handed_off_products_total 3\n") !=
+           std::string::npos);
+    // without hand-offs the products go through the inventory
+    factory.setHandOff(false);
+    factory.startCompanyBuyer(3,0,2);
+    usleep(20000);
+    factory.produce(3,productArr+6);
+    assert(factory.finishCompanyBuyer(2) == 0);
+    assert(factory.getStats().handed_off == 3);
+    avlList = factory.listAvailableProducts();
+    assert(avlList.size() == 1 && avlList.front().getId() == 9);
+    // the log replays hand-offs as products added and then bought
+    factory.flushEventLog();
+    std::list<Product> available;
+    std::list<std::pair<Product, int>> stolen;
+    assert(EventLog::replay(path, &available, &stolen) == 17);
+    assert(available.size() == 1 && available.front().getId() == 9);
+    unlink(path);
+    return 0;
+}
+
+struct McsWaiter {
+    FactoryLock *lock;
+    std::atomic<bool> locked;
+};
+
+void *mcsWaiterFunc(void *arg){
+    auto waiter = static_cast<McsWaiter *>(arg);
+    waiter->lock->lock();
+    waiter->locked = true;
+    waiter->lock->unlock();
+    return nullptr;
+}
+
+int mcsReleaseOrderTest(){
+    FactoryLock a(FactoryLock::MCS);
+    FactoryLock b(FactoryLock::MCS);
+    FactoryLock c(FactoryLock::MCS);
+    // a is released first, c must not reuse the node b is queued with
+    a.lock();
+    b.lock();
+    a.unlock();
+    c.lock();
+    McsWaiter waiter;
+    waiter.lock = &b;
+    waiter.locked = false;
+    pthread_t thread;
+    pthread_create(&thread, nullptr, mcsWaiterFunc, &waiter);
+    usleep(20000);
+    assert(!waiter.locked);
+    c.unlock();
+    usleep(20000);
+    assert(!waiter.locked);
+    b.unlock();
+    pthread_join(thread, nullptr);
+    assert(waiter.locked);
+    // more locks at once than the thread has queue nodes
+    std::vector<std::unique_ptr<FactoryLock>> locks;
+    for(int i=0 ; i<6 ; i++){
+        locks.emplace_back(new FactoryLock(FactoryLock::MCS));
+        locks.back()->lock();
+    }
+    for(int i : {2, 5, 0, 4, 1, 3}){
+        locks[i]->unlock();
+    }
+    for(auto &lock : locks){
+        lock->lock();
+        lock->unlock();
+    }
+    return 0;
+}
+
 int main(){
     startSimpleBuyerTest();
     produceTest();
@@ -307,7 +1325,31 @@ int main(){
     startThiefTest();
     startOpenCloseTest();
     startOpenCloseRetServiceTest();
+    tryBuyOneProbeTest();
     listStolenProductsTest();
     listAvailableProductsTest();
+    stolenLedgerTest();
+    persistentRestartTest();
+    persistentFailureTest();
+    eventLogReplayTest();
+    scheduleReplayTest();
+    lockPoliciesTest();
+    mcsReleaseOrderTest();
+    tryBuyManyTest();
+    capacityTest();
+    admissionTest();
+    reservationTest();
+    reservationQueueTest();
+    numaTopologyTest();
+    factoryGroupTest();
+    drainShutdownTest();
+    stagingTest();
+    metricsExporterTest();
+    productIndexTest();
+    recallTest();
+    recoverStolenTest();
+    fileProductionTest();
+    simulatorTest();
+    handoffTest();
     return 0;
 }
\ No newline at end of file
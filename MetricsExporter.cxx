@@ -0,0 +1,123 @@
+#include "MetricsExporter.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstring>
+
+namespace {
+// how often the thread checks whether it should stop
+const int ACCEPT_POLL_MS = 100;
+// how long a client has to send its request
+const int REQUEST_TIMEOUT_MS = 1000;
+}
+
+void *metricsExporterFunc(void *arg) {
+    static_cast<MetricsExporter *>(arg)->serve();
+    return nullptr;
+}
+
+MetricsExporter::MetricsExporter(Factory &factory,
+                                 const std::string &socket_path)
+        : factory(factory), socket_path(socket_path), listen_fd(-1),
+          stopping(false), thread_started(false) {
+    struct sockaddr_un address;
+    if (socket_path.size() >= sizeof(address.sun_path)) return;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, socket_path.c_str());
+    unlink(socket_path.c_str());
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) return;
+    if (bind(listen_fd, reinterpret_cast<struct sockaddr *>(&address),
+             sizeof(address)) != 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return;
+    }
+    start();
+}
+
+MetricsExporter::MetricsExporter(Factory &factory, int port)
+        : factory(factory), listen_fd(-1), stopping(false),
+          thread_started(false) {
+    struct sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) return;
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(listen_fd, reinterpret_cast<struct sockaddr *>(&address),
+             sizeof(address)) != 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return;
+    }
+    start();
+}
+
+MetricsExporter::~MetricsExporter() {
+    stopping = true;
+    if (thread_started) pthread_join(thread, nullptr);
+    if (listen_fd >= 0) close(listen_fd);
+    if (!socket_path.empty() && listen_fd >= 0) unlink(socket_path.c_str());
+}
+
+bool MetricsExporter::listening() const {
+    return thread_started;
+}
+
+void MetricsExporter::start() {
+    if (listen(listen_fd, 16) != 0 ||
+        pthread_create(&thread, nullptr, metricsExporterFunc, this) != 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return;
+    }
+    thread_started = true;
+}
+
+void MetricsExporter::serve() {
+    struct pollfd listener;
+    listener.fd = listen_fd;
+    listener.events = POLLIN;
+    while (!stopping) {
+        if (poll(&listener, 1, ACCEPT_POLL_MS) <= 0) continue;
+        int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) continue;
+        answer(client);
+        close(client);
+    }
+}
+
+void MetricsExporter::answer(int client) {
+    // the request is not parsed, reading until its blank line is enough
+    std::string request;
+    char buffer[1024];
+    struct pollfd reader;
+    reader.fd = client;
+    reader.events = POLLIN;
+    while (request.find("\r\n\r\n") == std::string::npos &&
+           request.find("\n\n") == std::string::npos) {
+        if (poll(&reader, 1, REQUEST_TIMEOUT_MS) <= 0) return;
+        ssize_t received = read(client, buffer, sizeof(buffer));
+        if (received <= 0) return;
+        request.append(buffer, received);
+    }
+    std::string response =
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n\r\n";
+    factory.renderMetrics(&response);
+    size_t sent = 0;
+    while (sent < response.size()) {
+        ssize_t written = send(client, response.data() + sent,
+                               response.size() - sent, MSG_NOSIGNAL);
+        if (written <= 0) return;
+        sent += written;
+    }
+}
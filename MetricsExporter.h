@@ -0,0 +1,52 @@
+#ifndef METRICS_EXPORTER_H_
+#define METRICS_EXPORTER_H_
+
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include "Factory.h"
+
+/*
+ * Serves a factory's metrics over HTTP, for Prometheus to scrape. A
+ * background thread answers every request, whatever its path, with
+ * Factory::renderMetrics, so scraping never takes the factory lock.
+ * Listen on a Unix socket and scrape it with
+ *   curl --unix-socket PATH http://localhost/metrics
+ * or on a TCP port of 127.0.0.1.
+ */
+class MetricsExporter {
+public:
+    // listens on a Unix socket at socket_path, replacing any existing file
+    MetricsExporter(Factory &factory, const std::string &socket_path);
+
+    // listens on 127.0.0.1:port
+    MetricsExporter(Factory &factory, int port);
+
+    // stops the thread and removes the Unix socket
+    ~MetricsExporter();
+
+    MetricsExporter(const MetricsExporter &) = delete;
+
+    MetricsExporter &operator=(const MetricsExporter &) = delete;
+
+    // false if the socket could not be set up, then nothing is served
+    bool listening() const;
+
+private:
+    friend void *metricsExporterFunc(void *);
+
+    void start();
+
+    void serve();
+
+    void answer(int client);
+
+    Factory &factory;
+    std::string socket_path;
+    int listen_fd;
+    std::atomic<bool> stopping;
+    pthread_t thread;
+    bool thread_started;
+};
+
+#endif // METRICS_EXPORTER_H_
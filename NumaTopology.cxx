@@ -0,0 +1,115 @@
+#include "NumaTopology.h"
+#include <dirent.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+
+NumaTopology::NumaTopology(const std::string &sysfs_root) {
+    // node directories are named node<N>, and N may have gaps
+    std::map<int, std::vector<int>> nodes;
+    DIR *dir = opendir(sysfs_root.c_str());
+    if (dir != nullptr) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            std::string name = entry->d_name;
+            if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+                name.find_first_not_of("0123456789", 4) != std::string::npos) {
+                continue;
+            }
+            std::ifstream in((sysfs_root + "/" + name + "/cpulist").c_str());
+            std::string list;
+            std::vector<int> cpus;
+            if (!std::getline(in, list) || !parseCpuList(list, &cpus) ||
+                cpus.empty()) {
+                continue;
+            }
+            nodes[std::atoi(name.c_str() + 4)] = cpus;
+        }
+        closedir(dir);
+    }
+    for (auto &node : nodes) node_cpus.push_back(node.second);
+    if (node_cpus.empty()) useSingleNode();
+}
+
+std::size_t NumaTopology::nodeCount() const {
+    return node_cpus.size();
+}
+
+const std::vector<int> &NumaTopology::cpusOf(std::size_t node) const {
+    return node_cpus[node];
+}
+
+int NumaTopology::nodeOfCpu(int cpu) const {
+    for (std::size_t node = 0; node < node_cpus.size(); ++node) {
+        for (int node_cpu : node_cpus[node]) {
+            if (node_cpu == cpu) return static_cast<int>(node);
+        }
+    }
+    return -1;
+}
+
+void NumaTopology::restrictToAffinity() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+    std::vector<std::vector<int>> restricted;
+    for (auto &cpus : node_cpus) {
+        std::vector<int> usable;
+        for (int cpu : cpus) {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                usable.push_back(cpu);
+            }
+        }
+        if (!usable.empty()) restricted.push_back(usable);
+    }
+    node_cpus.swap(restricted);
+    if (node_cpus.empty()) useSingleNode();
+}
+
+void NumaTopology::cpuSetOf(std::size_t node, cpu_set_t *set) const {
+    CPU_ZERO(set);
+    for (int cpu : node_cpus[node]) {
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, set);
+    }
+}
+
+bool NumaTopology::parseCpuList(const std::string &list,
+                                std::vector<int> *cpus) {
+    std::size_t position = 0;
+    while (position < list.size() && list[position] != '\n') {
+        char *end;
+        long first = std::strtol(list.c_str() + position, &end, 10);
+        if (end == list.c_str() + position || first < 0) return false;
+        long last = first;
+        if (*end == '-') {
+            const char *second = end + 1;
+            last = std::strtol(second, &end, 10);
+            if (end == second || last < first) return false;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus->push_back(static_cast<int>(cpu));
+        }
+        position = end - list.c_str();
+        if (position < list.size() && list[position] == ',') position++;
+        else if (position < list.size() && list[position] != '\n') return false;
+    }
+    return true;
+}
+
+void NumaTopology::useSingleNode() {
+    node_cpus.assign(1, std::vector<int>());
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) node_cpus[0].push_back(cpu);
+        }
+    }
+    if (node_cpus[0].empty()) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long cpu = 0; cpu < online; ++cpu) {
+            node_cpus[0].push_back(static_cast<int>(cpu));
+        }
+    }
+}
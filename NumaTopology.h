@@ -0,0 +1,45 @@
+#ifndef NUMA_TOPOLOGY_H_
+#define NUMA_TOPOLOGY_H_
+
+#include <sched.h>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+ * The machine's NUMA nodes and their CPUs, read from sysfs.
+ * On a machine without NUMA, or without sysfs, there is a single node with
+ * every CPU the process may run on. The sysfs root can be replaced, so the
+ * parsing can be tested with a fake tree.
+ */
+class NumaTopology {
+public:
+    explicit NumaTopology(
+            const std::string &sysfs_root = "/sys/devices/system/node");
+
+    std::size_t nodeCount() const;
+
+    const std::vector<int> &cpusOf(std::size_t node) const;
+
+    // the node the cpu belongs to, or -1 if it belongs to none
+    int nodeOfCpu(int cpu) const;
+
+    /*
+     * Drops the CPUs the process may not run on, and the nodes left without
+     * CPUs. If no node is left, falls back to a single node.
+     */
+    void restrictToAffinity();
+
+    // fills set with the CPUs of node
+    void cpuSetOf(std::size_t node, cpu_set_t *set) const;
+
+    // parses a sysfs CPU list such as "0-3,8,10-11"
+    static bool parseCpuList(const std::string &list, std::vector<int> *cpus);
+
+private:
+    void useSingleNode();
+
+    std::vector<std::vector<int>> node_cpus;
+};
+
+#endif // NUMA_TOPOLOGY_H_
@@ -0,0 +1,309 @@
+#include "PersistentStore.h"
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+const uint32_t STORE_MAGIC = 0x46414354; // "FACT"
+const uint32_t STORE_VERSION = 1;
+const std::size_t HEADER_BYTES = 4096;
+const std::size_t INITIAL_REGION_BYTES = 1 << 16;
+
+void throwErrno(const std::string &what) {
+    throw std::runtime_error(what + ": " + std::strerror(errno));
+}
+}
+
+/*
+ * The available FIFO is described by a (head, tail) pair. There are two
+ * pairs, and active_slot selects the one in use. Pushes and pops only touch
+ * one counter of the active pair. Operations that move both counters at
+ * once write the inactive pair and then flip active_slot, so a crash always
+ * leaves one consistent pair behind.
+ */
+struct PersistentStore::Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t open_to_visitors;
+    uint32_t open_to_returns;
+    uint32_t active_slot;
+    uint32_t reserved;
+    uint64_t head[2];
+    uint64_t tail[2];
+    uint64_t stolen_count;
+};
+
+PersistentStore::PersistentStore(const std::string &path)
+        : header(nullptr), was_attached(false) {
+    try {
+        openRegion(&header_region, path, HEADER_BYTES);
+        header = static_cast<Header *>(header_region.data);
+        if (header->magic == 0) {
+            header->version = STORE_VERSION;
+            header->open_to_visitors = 1;
+            header->open_to_returns = 1;
+            std::atomic_thread_fence(std::memory_order_release);
+            header->magic = STORE_MAGIC;
+        } else if (header->magic != STORE_MAGIC ||
+                   header->version != STORE_VERSION ||
+                   header->active_slot > 1) {
+            throw std::runtime_error(path + ": not a factory store");
+        } else {
+            was_attached = true;
+        }
+        openRegion(&available_region, path + ".available",
+                   INITIAL_REGION_BYTES);
+        openRegion(&stolen_region, path + ".stolen", INITIAL_REGION_BYTES);
+        // stores written before recoveries existed have no such file yet
+        openRegion(&recovered_region, path + ".recovered",
+                   INITIAL_REGION_BYTES);
+        uint32_t slot = header->active_slot;
+        if (header->head[slot] > header->tail[slot] ||
+            header->tail[slot] * sizeof(StoredProduct) >
+            available_region.bytes ||
+            header->stolen_count * sizeof(StoredTheft) > stolen_region.bytes) {
+            throw std::runtime_error(path + ": corrupted factory store");
+        }
+        if (header->stolen_count > recovered_region.bytes &&
+            !growRegion(&recovered_region, header->stolen_count)) {
+            throw std::runtime_error(write_error);
+        }
+    } catch (...) {
+        closeRegion(&recovered_region);
+        closeRegion(&stolen_region);
+        closeRegion(&available_region);
+        closeRegion(&header_region);
+        throw;
+    }
+}
+
+PersistentStore::~PersistentStore() {
+    closeRegion(&recovered_region);
+    closeRegion(&stolen_region);
+    closeRegion(&available_region);
+    closeRegion(&header_region);
+}
+
+void PersistentStore::openRegion(Region *region, const std::string &path,
+                                 std::size_t initial_bytes) {
+    region->fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (region->fd < 0) throwErrno(path);
+    struct stat st;
+    if (fstat(region->fd, &st) < 0) throwErrno(path);
+    std::size_t bytes = static_cast<std::size_t>(st.st_size);
+    if (bytes < initial_bytes) {
+        bytes = initial_bytes;
+        if (ftruncate(region->fd, bytes) < 0) throwErrno(path);
+    }
+    region->data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        region->fd, 0);
+    if (region->data == MAP_FAILED) {
+        region->data = nullptr;
+        throwErrno(path);
+    }
+    region->bytes = bytes;
+}
+
+/*
+ * Does not throw, the factory calls the writers with its lock held. A
+ * failure is kept in write_error and every later write is dropped, so the
+ * files keep the last state that was fully written.
+ */
+bool PersistentStore::growRegion(Region *region, std::size_t min_bytes) {
+    std::size_t bytes = region->bytes;
+    while (bytes < min_bytes) bytes *= 2;
+    void *data = MAP_FAILED;
+    if (ftruncate(region->fd, bytes) == 0) {
+        data = mremap(region->data, region->bytes, bytes, MREMAP_MAYMOVE);
+    }
+    if (data == MAP_FAILED) {
+        write_error = std::string("factory store: ") + std::strerror(errno);
+        return false;
+    }
+    region->data = data;
+    region->bytes = bytes;
+    return true;
+}
+
+void PersistentStore::closeRegion(Region *region) {
+    if (region->data != nullptr) munmap(region->data, region->bytes);
+    if (region->fd >= 0) close(region->fd);
+    region->data = nullptr;
+    region->fd = -1;
+}
+
+bool PersistentStore::attached() const {
+    return was_attached;
+}
+
+bool PersistentStore::failed() const {
+    return !write_error.empty();
+}
+
+const std::string &PersistentStore::writeError() const {
+    return write_error;
+}
+
+bool PersistentStore::openToVisitors() const {
+    return header->open_to_visitors != 0;
+}
+
+bool PersistentStore::openToReturns() const {
+    return header->open_to_returns != 0;
+}
+
+void PersistentStore::setOpenToVisitors(bool open) {
+    if (failed()) return;
+    header->open_to_visitors = open ? 1 : 0;
+    syncHeader();
+}
+
+void PersistentStore::setOpenToReturns(bool open) {
+    if (failed()) return;
+    header->open_to_returns = open ? 1 : 0;
+    syncHeader();
+}
+
+std::size_t PersistentStore::availableCount() const {
+    uint32_t slot = header->active_slot;
+    return header->tail[slot] - header->head[slot];
+}
+
+const PersistentStore::StoredProduct *PersistentStore::availableBegin() const {
+    return static_cast<const StoredProduct *>(available_region.data) +
+           header->head[header->active_slot];
+}
+
+void PersistentStore::pushAvailable(int id, int value) {
+    if (failed()) return;
+    uint32_t slot = header->active_slot;
+    std::size_t needed = (header->tail[slot] + 1) * sizeof(StoredProduct);
+    if (needed > available_region.bytes) {
+        // reuse the popped prefix when the live records fit in it
+        if (header->head[slot] >= header->tail[slot] - header->head[slot]) {
+            compactAvailable();
+            slot = header->active_slot;
+            needed = (header->tail[slot] + 1) * sizeof(StoredProduct);
+        }
+        if (needed > available_region.bytes &&
+            !growRegion(&available_region, needed)) {
+            return;
+        }
+    }
+    StoredProduct *record = static_cast<StoredProduct *>(
+            available_region.data) + header->tail[slot];
+    record->id = id;
+    record->value = value;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->tail[slot]++;
+}
+
+void PersistentStore::popAvailable() {
+    if (failed()) return;
+    uint32_t slot = header->active_slot;
+    header->head[slot]++;
+    if (header->head[slot] == header->tail[slot]) {
+        // the FIFO is empty, start over at the beginning of the file
+        uint32_t next = 1 - slot;
+        header->head[next] = 0;
+        header->tail[next] = 0;
+        std::atomic_thread_fence(std::memory_order_release);
+        header->active_slot = next;
+    }
+}
+
+void PersistentStore::removeAvailable(const std::unordered_set<int> &ids) {
+    if (failed()) return;
+    uint32_t slot = header->active_slot;
+    std::size_t head = header->head[slot];
+    std::size_t tail = header->tail[slot];
+    std::size_t needed = (2 * tail - head) * sizeof(StoredProduct);
+    if (needed > available_region.bytes &&
+        !growRegion(&available_region, needed)) {
+        return;
+    }
+    StoredProduct *records = static_cast<StoredProduct *>(
+            available_region.data);
+    std::size_t kept = tail;
+    for (std::size_t i = head; i < tail; ++i) {
+        if (ids.count(records[i].id) == 0) records[kept++] = records[i];
+    }
+    uint32_t next = 1 - slot;
+    // like popAvailable, an empty FIFO starts over at the beginning
+    header->head[next] = kept == tail ? 0 : tail;
+    header->tail[next] = kept == tail ? 0 : kept;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->active_slot = next;
+}
+
+/*
+ * Moves the live records to the beginning of the file. Only called when the
+ * live records do not overlap their destination, so the old copy stays
+ * intact until active_slot is flipped.
+ */
+void PersistentStore::compactAvailable() {
+    uint32_t slot = header->active_slot;
+    uint32_t next = 1 - slot;
+    std::size_t live = header->tail[slot] - header->head[slot];
+    StoredProduct *records = static_cast<StoredProduct *>(
+            available_region.data);
+    std::memcpy(records, records + header->head[slot],
+                live * sizeof(StoredProduct));
+    header->head[next] = 0;
+    header->tail[next] = live;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->active_slot = next;
+}
+
+std::size_t PersistentStore::stolenCount() const {
+    return header->stolen_count;
+}
+
+const PersistentStore::StoredTheft *PersistentStore::stolenBegin() const {
+    return static_cast<const StoredTheft *>(stolen_region.data);
+}
+
+void PersistentStore::appendStolen(int id, int value, int fake_id) {
+    if (failed()) return;
+    std::size_t needed = (header->stolen_count + 1) * sizeof(StoredTheft);
+    if (needed > stolen_region.bytes &&
+        !growRegion(&stolen_region, needed)) {
+        return;
+    }
+    StoredTheft *record = static_cast<StoredTheft *>(stolen_region.data) +
+                          header->stolen_count;
+    record->id = id;
+    record->value = value;
+    record->fake_id = fake_id;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->stolen_count++;
+}
+
+bool PersistentStore::stolenRecovered(std::size_t row) const {
+    return row < recovered_region.bytes &&
+           static_cast<const uint8_t *>(recovered_region.data)[row] != 0;
+}
+
+void PersistentStore::markRecovered(std::size_t row) {
+    if (failed()) return;
+    if (row >= recovered_region.bytes &&
+        !growRegion(&recovered_region, row + 1)) {
+        return;
+    }
+    static_cast<uint8_t *>(recovered_region.data)[row] = 1;
+}
+
+void PersistentStore::checkpoint() {
+    msync(available_region.data, available_region.bytes, MS_SYNC);
+    msync(stolen_region.data, stolen_region.bytes, MS_SYNC);
+    msync(recovered_region.data, recovered_region.bytes, MS_SYNC);
+    syncHeader();
+}
+
+void PersistentStore::syncHeader() {
+    msync(header_region.data, header_region.bytes, MS_SYNC);
+}
@@ -0,0 +1,126 @@
+#ifndef PERSISTENT_STORE_H_
+#define PERSISTENT_STORE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+
+/*
+ * Memory-mapped mirror of a factory's state, used to restart a factory
+ * without producing its whole inventory again.
+ * The state is kept in four files that share the same path prefix:
+ *   <path>            header: open/closed flags and the record counters
+ *   <path>.available  available products, a FIFO of (id, value) records
+ *   <path>.stolen     stolen products, (id, value, fake_id) records
+ *   <path>.recovered  one byte per stolen record, 1 once it was recovered
+ * Every update is a plain store into a shared mapping, so the state survives
+ * a crash of the process. checkpoint() also makes it survive a crash of the
+ * machine. The store is not thread safe, the factory guards it with its lock.
+ * For the same reason the writers do not throw: when a file can not grow,
+ * the error is kept and the store stops following the factory.
+ */
+class PersistentStore {
+public:
+    struct StoredProduct {
+        int32_t id;
+        int32_t value;
+    };
+
+    struct StoredTheft {
+        int32_t id;
+        int32_t value;
+        int32_t fake_id;
+    };
+
+    /*
+     * Opens the store at path, creating empty files if there are none.
+     * Throws std::runtime_error if the files exist but are not a valid store.
+     */
+    explicit PersistentStore(const std::string &path);
+
+    ~PersistentStore();
+
+    PersistentStore(const PersistentStore &) = delete;
+
+    PersistentStore &operator=(const PersistentStore &) = delete;
+
+    // true if the store was opened over an existing state
+    bool attached() const;
+
+    // true once a write failed, every later write is dropped
+    bool failed() const;
+
+    // the reason of the first failed write, empty if there was none
+    const std::string &writeError() const;
+
+    bool openToVisitors() const;
+
+    bool openToReturns() const;
+
+    void setOpenToVisitors(bool open);
+
+    void setOpenToReturns(bool open);
+
+    std::size_t availableCount() const;
+
+    const StoredProduct *availableBegin() const;
+
+    void pushAvailable(int id, int value);
+
+    void popAvailable();
+
+    /*
+     * Removes every available product with one of ids. The remaining
+     * records are copied after the current ones before the header switches
+     * to them, so a crash keeps either the old or the new inventory.
+     */
+    void removeAvailable(const std::unordered_set<int> &ids);
+
+    std::size_t stolenCount() const;
+
+    const StoredTheft *stolenBegin() const;
+
+    void appendStolen(int id, int value, int fake_id);
+
+    bool stolenRecovered(std::size_t row) const;
+
+    // marks the stolen record row recovered, the record itself stays
+    void markRecovered(std::size_t row);
+
+    // flushes every mapping to disk
+    void checkpoint();
+
+private:
+    struct Header;
+
+    struct Region {
+        Region() : fd(-1), data(nullptr), bytes(0) {}
+
+        int fd;
+        void *data;
+        std::size_t bytes;
+    };
+
+    void openRegion(Region *region, const std::string &path,
+                    std::size_t initial_bytes);
+
+    bool growRegion(Region *region, std::size_t min_bytes);
+
+    void closeRegion(Region *region);
+
+    void compactAvailable();
+
+    // flushes the header page, used for the cheap flag checkpoints
+    void syncHeader();
+
+    Region header_region;
+    Region available_region;
+    Region stolen_region;
+    Region recovered_region;
+    Header *header;
+    bool was_attached;
+    std::string write_error;
+};
+
+#endif // PERSISTENT_STORE_H_
@@ -1,20 +1,28 @@
-
 #ifndef PRODUCT_H_
 #define PRODUCT_H_
 
+/*
+ * The only product type of the factory, which is not a template over it.
+ * The store, the event log and the stolen ledger keep products as fixed
+ * (id, value) records and rebuild them from those on restart, replay and
+ * recovery, so a product can not carry anything else. Inside the factory
+ * products move between lists by splicing their nodes. A product is only
+ * copied when produce adds it from the caller's array, and when
+ * listAvailableProducts copies the inventory.
+ */
 class Product{
     int id;
     int value;
 public:
-    Product(){}
+    Product() : id(0), value(0){}
     Product(int id,int value){
         this->id = id;
         this->value = value;
     }
-    int getId(){
+    int getId() const{
         return id;
     }
-    int getValue(){
+    int getValue() const{
         return value;
     }
 };
@@ -0,0 +1,78 @@
+#include "ProductFile.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ProductFile::ProductFile(const std::string &path)
+        : fd(-1), data(nullptr), bytes(0), count(0) {
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error(path + ": " + std::strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int error = errno;
+        close(fd);
+        throw std::runtime_error(path + ": " + std::strerror(error));
+    }
+    bytes = static_cast<std::size_t>(st.st_size);
+    count = bytes / sizeof(Record);
+    // an empty file can not be mapped, and has nothing to map
+    if (count == 0) return;
+    data = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        int error = errno;
+        data = nullptr;
+        close(fd);
+        throw std::runtime_error(path + ": " + std::strerror(error));
+    }
+    madvise(data, bytes, MADV_SEQUENTIAL);
+}
+
+ProductFile::~ProductFile() {
+    if (data != nullptr) munmap(data, bytes);
+    if (fd >= 0) close(fd);
+}
+
+std::size_t ProductFile::size() const {
+    return count;
+}
+
+const ProductFile::Record *ProductFile::records() const {
+    return static_cast<const Record *>(data);
+}
+
+bool ProductFile::pageRange(std::size_t begin, std::size_t end, char **start,
+                            std::size_t *length) const {
+    if (end > count) end = count;
+    if (begin >= end) return false;
+    static const std::size_t page = static_cast<std::size_t>(
+            sysconf(_SC_PAGESIZE));
+    std::size_t first = begin * sizeof(Record) / page * page;
+    std::size_t last = end * sizeof(Record);
+    *start = static_cast<char *>(data) + first;
+    *length = last - first;
+    return true;
+}
+
+void ProductFile::willNeed(std::size_t begin, std::size_t end) {
+    char *start;
+    std::size_t length;
+    if (pageRange(begin, end, &start, &length)) {
+        madvise(start, length, MADV_WILLNEED);
+    }
+}
+
+void ProductFile::done(std::size_t begin, std::size_t end) {
+    char *start;
+    std::size_t length;
+    if (!pageRange(begin, end, &start, &length)) return;
+    // the page that holds end may still have records to read
+    std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    length = length / page * page;
+    if (length > 0) madvise(start, length, MADV_DONTNEED);
+}
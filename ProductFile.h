@@ -0,0 +1,57 @@
+#ifndef PRODUCT_FILE_H_
+#define PRODUCT_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * Read-only memory mapping of a file of products, the input of
+ * Factory::produceFromFile. The file is a plain array of (id, value)
+ * records of two native-endian 32 bit integers, the same records as a
+ * PersistentStore's available file. A torn record at the end is ignored.
+ * The records are read straight from the page cache, and the file tells
+ * the kernel which pages are needed next and which are done with.
+ */
+class ProductFile {
+public:
+    struct Record {
+        int32_t id;
+        int32_t value;
+    };
+
+    /*
+     * Maps the file at path. Throws std::runtime_error if it can not be
+     * opened or mapped.
+     */
+    explicit ProductFile(const std::string &path);
+
+    ~ProductFile();
+
+    ProductFile(const ProductFile &) = delete;
+
+    ProductFile &operator=(const ProductFile &) = delete;
+
+    // the number of records
+    std::size_t size() const;
+
+    const Record *records() const;
+
+    // asks the kernel to read records [begin, end) ahead of time
+    void willNeed(std::size_t begin, std::size_t end);
+
+    // lets the kernel drop the mapped pages of records [begin, end)
+    void done(std::size_t begin, std::size_t end);
+
+private:
+    // rounds the byte range of records [begin, end) out to whole pages
+    bool pageRange(std::size_t begin, std::size_t end, char **start,
+                   std::size_t *length) const;
+
+    int fd;
+    void *data;
+    std::size_t bytes;
+    std::size_t count;
+};
+
+#endif // PRODUCT_FILE_H_
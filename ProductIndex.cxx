@@ -0,0 +1,116 @@
+#include "ProductIndex.h"
+#include <algorithm>
+
+namespace {
+const unsigned int INITIAL_BITS = 4;
+}
+
+ProductIndex::ProductIndex()
+        : slots(std::size_t(1) << INITIAL_BITS), count(0),
+          free_slots(std::size_t(1) << INITIAL_BITS), bits(INITIAL_BITS) {
+    for (auto &slot : slots) slot.used = false;
+}
+
+std::size_t ProductIndex::home(int id) const {
+    // Fibonacci hashing, the high bits of the product are well mixed
+    uint64_t key = static_cast<uint32_t>(id);
+    return static_cast<std::size_t>((key * 0x9E3779B97F4A7C15ULL) >>
+                                    (64 - bits));
+}
+
+std::size_t ProductIndex::slotOf(int id) const {
+    std::size_t mask = slots.size() - 1;
+    std::size_t i = home(id);
+    while (slots[i].used && slots[i].id != id) i = (i + 1) & mask;
+    return i;
+}
+
+void ProductIndex::insert(int id, Position position) {
+    count++;
+    std::size_t i = slotOf(id);
+    if (slots[i].used) {
+        duplicates[id].push_back(position);
+        return;
+    }
+    // at most three quarters full, so probe runs stay short
+    if ((slots.size() - free_slots + 1) * 4 > slots.size() * 3) {
+        grow();
+        i = slotOf(id);
+    }
+    slots[i].position = position;
+    slots[i].id = id;
+    slots[i].used = true;
+    free_slots--;
+}
+
+void ProductIndex::erase(int id, Position position) {
+    std::size_t i = slotOf(id);
+    if (!slots[i].used) return;
+    auto younger = duplicates.find(id);
+    if (slots[i].position != position) {
+        if (younger == duplicates.end()) return;
+        auto &queue = younger->second;
+        auto found = std::find(queue.begin(), queue.end(), position);
+        if (found == queue.end()) return;
+        queue.erase(found);
+        if (queue.empty()) duplicates.erase(younger);
+        count--;
+        return;
+    }
+    count--;
+    if (younger != duplicates.end()) {
+        slots[i].position = younger->second.front();
+        younger->second.pop_front();
+        if (younger->second.empty()) duplicates.erase(younger);
+        return;
+    }
+    removeSlot(i);
+}
+
+void ProductIndex::removeSlot(std::size_t i) {
+    std::size_t mask = slots.size() - 1;
+    // moves back the entries of the run that could not use slot i
+    std::size_t j = i;
+    while (true) {
+        j = (j + 1) & mask;
+        if (!slots[j].used) break;
+        std::size_t k = home(slots[j].id);
+        bool movable = i <= j ? (k <= i || k > j) : (k <= i && k > j);
+        if (!movable) continue;
+        slots[i] = slots[j];
+        i = j;
+    }
+    slots[i].used = false;
+    free_slots++;
+}
+
+bool ProductIndex::find(int id, Position *position) const {
+    std::size_t i = slotOf(id);
+    if (!slots[i].used) return false;
+    *position = slots[i].position;
+    return true;
+}
+
+std::size_t ProductIndex::size() const {
+    return count;
+}
+
+std::size_t ProductIndex::memoryBytes() const {
+    return slots.size() * sizeof(Slot);
+}
+
+void ProductIndex::grow() {
+    std::vector<Slot> old;
+    old.swap(slots);
+    bits++;
+    slots.resize(std::size_t(1) << bits);
+    free_slots = slots.size() - (old.size() - free_slots);
+    for (auto &slot : slots) slot.used = false;
+    std::size_t mask = slots.size() - 1;
+    for (auto &slot : old) {
+        if (!slot.used) continue;
+        std::size_t i = home(slot.id);
+        while (slots[i].used) i = (i + 1) & mask;
+        slots[i] = slot;
+    }
+}
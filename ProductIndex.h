@@ -0,0 +1,69 @@
+#ifndef PRODUCT_INDEX_H_
+#define PRODUCT_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include "Product.h"
+
+/*
+ * Hash index from product ids to the products' nodes in the factory's
+ * inventory list. List iterators stay valid while their node is in the
+ * list, even across splices, so the index only changes when a product
+ * enters or leaves the inventory.
+ * The table uses open addressing with linear probing and backward-shift
+ * deletion: entries live in one array, so indexing a product does not
+ * allocate except when the table doubles.
+ * Ids may repeat. The table holds the oldest product of every id, the
+ * younger ones wait in a queue per id. The inventory only loses the oldest
+ * product of an id, so erasing a duplicate stays O(1).
+ * The index is not thread safe, the factory guards it with its lock.
+ */
+class ProductIndex {
+public:
+    typedef std::list<Product>::iterator Position;
+
+    ProductIndex();
+
+    void insert(int id, Position position);
+
+    // removes the entry of position, which was inserted under id
+    void erase(int id, Position position);
+
+    // finds the oldest product with id, false if there is none
+    bool find(int id, Position *position) const;
+
+    std::size_t size() const;
+
+    // bytes used by the table, for benchmarks
+    std::size_t memoryBytes() const;
+
+private:
+    struct Slot {
+        Position position;
+        int id;
+        bool used;
+    };
+
+    std::size_t home(int id) const;
+
+    // the slot of id, or the empty slot that ends its probe run
+    std::size_t slotOf(int id) const;
+
+    void removeSlot(std::size_t i);
+
+    void grow();
+
+    std::vector<Slot> slots;
+    // the younger products of the ids that repeat, oldest first
+    std::unordered_map<int, std::deque<Position>> duplicates;
+    std::size_t count;
+    std::size_t free_slots;
+    // log2 of the number of slots
+    unsigned int bits;
+};
+
+#endif // PRODUCT_INDEX_H_
@@ -0,0 +1,65 @@
+#include "Schedule.h"
+#include <fstream>
+
+const char Schedule::MAIN;
+const char Schedule::PRODUCER;
+const char Schedule::SIMPLE_BUYER;
+const char Schedule::COMPANY_BUYER;
+const char Schedule::THIEF;
+
+Schedule::Schedule(Mode mode) : schedule_mode(mode), position(0) {}
+
+Schedule::Schedule(Mode mode, const std::vector<Event> &events)
+        : schedule_mode(mode), recorded(events), position(0) {}
+
+Schedule::Mode Schedule::mode() const {
+    return schedule_mode;
+}
+
+const std::vector<Schedule::Event> &Schedule::events() const {
+    return recorded;
+}
+
+void Schedule::record(char role, unsigned int id, EventKind kind) {
+    Event event;
+    event.role = role;
+    event.id = id;
+    event.kind = kind;
+    recorded.push_back(event);
+}
+
+bool Schedule::isTurn(char role, unsigned int id, EventKind kind) const {
+    if (position >= recorded.size()) return true;
+    const Event &next = recorded[position];
+    return next.role == role && next.id == id && next.kind == kind;
+}
+
+void Schedule::advance() {
+    position++;
+}
+
+bool Schedule::finished() const {
+    return schedule_mode == REPLAY && position >= recorded.size();
+}
+
+bool Schedule::save(const std::string &path) const {
+    std::ofstream out(path.c_str());
+    for (auto &event : recorded) {
+        out << event.role << " " << event.id << " "
+            << (event.kind == LOCK ? 'L' : 'W') << "\n";
+    }
+    return static_cast<bool>(out);
+}
+
+bool Schedule::load(const std::string &path, std::vector<Event> *events) {
+    std::ifstream in(path.c_str());
+    if (!in) return false;
+    Event event;
+    char kind;
+    while (in >> event.role >> event.id >> kind) {
+        if (kind != 'L' && kind != 'W') return false;
+        event.kind = kind == 'L' ? LOCK : WAKE;
+        events->push_back(event);
+    }
+    return in.eof();
+}
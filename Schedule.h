@@ -0,0 +1,75 @@
+#ifndef SCHEDULE_H_
+#define SCHEDULE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * The order in which the factory's threads got the factory lock, used to
+ * reproduce an interleaving of a concurrent run.
+ * In record mode the factory appends an event every time a thread takes the
+ * lock or wakes up from one of the factory's condition variables. In replay
+ * mode the factory only lets the thread of the next recorded event through,
+ * which forces the recorded interleaving. When the recorded events run out
+ * the threads run freely again.
+ * Threads are named by their role and visitor id, so the same program run
+ * twice names its threads the same way. The schedule is not thread safe, the
+ * factory guards it with its lock.
+ */
+class Schedule {
+public:
+    enum Mode {
+        RECORD,
+        REPLAY
+    };
+
+    enum EventKind {
+        LOCK = 0,
+        WAKE = 1
+    };
+
+    // the roles used in thread tags
+    static const char MAIN = 'M';
+    static const char PRODUCER = 'P';
+    static const char SIMPLE_BUYER = 'S';
+    static const char COMPANY_BUYER = 'C';
+    static const char THIEF = 'T';
+
+    struct Event {
+        char role;
+        unsigned int id;
+        EventKind kind;
+    };
+
+    explicit Schedule(Mode mode);
+
+    Schedule(Mode mode, const std::vector<Event> &events);
+
+    Mode mode() const;
+
+    const std::vector<Event> &events() const;
+
+    void record(char role, unsigned int id, EventKind kind);
+
+    // true if the next event belongs to the given thread or the replay is over
+    bool isTurn(char role, unsigned int id, EventKind kind) const;
+
+    void advance();
+
+    // true once a replay consumed every recorded event
+    bool finished() const;
+
+    // one "<role> <id> <L|W>" line per event
+    bool save(const std::string &path) const;
+
+    static bool load(const std::string &path, std::vector<Event> *events);
+
+private:
+    Mode schedule_mode;
+    std::vector<Event> recorded;
+    std::size_t position;
+};
+
+#endif // SCHEDULE_H_
@@ -0,0 +1,56 @@
+#include "StolenLedger.h"
+
+const std::size_t StolenLedger::CHUNK_SIZE;
+
+StolenLedger::StolenLedger() : count(0), recovered_count(0) {}
+
+std::size_t StolenLedger::appendRow(int product_id, int product_value,
+                                    int fake_id) {
+    std::size_t row = count % CHUNK_SIZE;
+    // new chunks are value-initialized, no row is recovered
+    if (row == 0) chunks.emplace_back();
+    Chunk &chunk = chunks.back();
+    chunk.ids[row] = product_id;
+    chunk.values[row] = product_value;
+    chunk.fake_ids[row] = fake_id;
+    return count++;
+}
+
+void StolenLedger::append(int product_id, int product_value, int fake_id) {
+    thief_rows[fake_id].push_back(appendRow(product_id, product_value,
+                                            fake_id));
+    ThiefTotals &totals = per_thief[fake_id];
+    totals.count++;
+    totals.value += product_value;
+}
+
+void StolenLedger::appendRecovered(int product_id, int product_value,
+                                   int fake_id) {
+    std::size_t row = appendRow(product_id, product_value, fake_id);
+    setRecovered(&chunks.back(), row % CHUNK_SIZE);
+    recovered_count++;
+}
+
+std::size_t StolenLedger::size() const {
+    return count - recovered_count;
+}
+
+StolenLedger::ThiefTotals StolenLedger::totalsFor(int fake_id) const {
+    auto i = per_thief.find(fake_id);
+    if (i == per_thief.end()) return ThiefTotals();
+    return i->second;
+}
+
+const std::unordered_map<int, StolenLedger::ThiefTotals> &
+StolenLedger::totals() const {
+    return per_thief;
+}
+
+std::list<std::pair<Product, int>> StolenLedger::toList() const {
+    std::list<std::pair<Product, int>> rows;
+    forEach([&rows](int product_id, int product_value, int fake_id) {
+        rows.push_back(std::pair<Product, int>(
+                Product(product_id, product_value), fake_id));
+    });
+    return rows;
+}
@@ -0,0 +1,140 @@
+#ifndef STOLEN_LEDGER_H_
+#define STOLEN_LEDGER_H_
+
+#include <cstddef>
+#include <deque>
+#include <list>
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "Product.h"
+
+/*
+ * Append-only record of every product a thief took from the factory.
+ * Rows are stored column by column (id, value, fake_id) in fixed size chunks,
+ * so an append is O(1) and never allocates a node of its own.
+ * The ledger also keeps running totals and the rows of every thief, so a
+ * thief's products can be recovered without scanning the other rows. The
+ * row numbers take 8 more bytes per row, in one vector per thief, so a row
+ * costs about 20 bytes, plus one map entry per thief, where a list node of
+ * the same row took about 48.
+ * Recovered rows stay in place with a recovered bit set, the ledger skips
+ * them from then on.
+ * The ledger is not thread safe, the factory guards it with its lock.
+ */
+class StolenLedger {
+public:
+    static const std::size_t CHUNK_SIZE = 1024;
+
+    struct ThiefTotals {
+        ThiefTotals() : count(0), value(0) {}
+
+        unsigned long count;
+        long long value;
+    };
+
+    StolenLedger();
+
+    void append(int product_id, int product_value, int fake_id);
+
+    // appends a row that was already recovered, to reload a saved ledger
+    void appendRecovered(int product_id, int product_value, int fake_id);
+
+    // the number of rows that were not recovered
+    std::size_t size() const;
+
+    ThiefTotals totalsFor(int fake_id) const;
+
+    const std::unordered_map<int, ThiefTotals> &totals() const;
+
+    /*
+     * Calls visit(product_id, product_value, fake_id) for every row, in the
+     * order the products were stolen.
+     */
+    template<class Visitor>
+    void forEach(Visitor visit) const {
+        std::size_t remaining = count;
+        for (auto chunk = chunks.begin();
+             chunk != chunks.end() && remaining > 0; ++chunk) {
+            std::size_t rows = remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE;
+            for (std::size_t i = 0; i < rows; ++i) {
+                if (isRecovered(*chunk, i)) continue;
+                visit(chunk->ids[i], chunk->values[i], chunk->fake_ids[i]);
+            }
+            remaining -= rows;
+        }
+    }
+
+    /*
+     * Marks every row of the thief fake_id recovered, calling
+     * visit(row, product_id, product_value) for each in the order they
+     * were stolen. Returns the number of rows recovered.
+     */
+    template<class Visitor>
+    std::size_t recover(int fake_id, Visitor visit) {
+        auto thief = thief_rows.find(fake_id);
+        if (thief == thief_rows.end()) return 0;
+        std::size_t recovered = thief->second.size();
+        for (std::size_t row : thief->second) {
+            Chunk &chunk = chunks[row / CHUNK_SIZE];
+            std::size_t i = row % CHUNK_SIZE;
+            setRecovered(&chunk, i);
+            visit(row, chunk.ids[i], chunk.values[i]);
+        }
+        thief_rows.erase(thief);
+        per_thief.erase(fake_id);
+        recovered_count += recovered;
+        return recovered;
+    }
+
+    /*
+     * Recovers the rows of every thief, thief by thief in increasing
+     * fake_id order, calling visit(row, product_id, product_value, fake_id).
+     */
+    template<class Visitor>
+    std::size_t recoverAll(Visitor visit) {
+        std::vector<int> thieves;
+        for (auto &thief : thief_rows) thieves.push_back(thief.first);
+        std::sort(thieves.begin(), thieves.end());
+        std::size_t recovered = 0;
+        for (int fake_id : thieves) {
+            recovered += recover(fake_id, [&](std::size_t row, int product_id,
+                                              int product_value) {
+                visit(row, product_id, product_value, fake_id);
+            });
+        }
+        return recovered;
+    }
+
+    std::list<std::pair<Product, int>> toList() const;
+
+private:
+    struct Chunk {
+        int ids[CHUNK_SIZE];
+        int values[CHUNK_SIZE];
+        int fake_ids[CHUNK_SIZE];
+        uint64_t recovered[CHUNK_SIZE / 64];
+    };
+
+    static bool isRecovered(const Chunk &chunk, std::size_t i) {
+        return (chunk.recovered[i / 64] >> (i % 64)) & 1;
+    }
+
+    static void setRecovered(Chunk *chunk, std::size_t i) {
+        chunk->recovered[i / 64] |= uint64_t(1) << (i % 64);
+    }
+
+    // appends a row and returns its number
+    std::size_t appendRow(int product_id, int product_value, int fake_id);
+
+    std::deque<Chunk> chunks;
+    // rows appended, recovered_count of them were recovered
+    std::size_t count;
+    std::size_t recovered_count;
+    std::unordered_map<int, ThiefTotals> per_thief;
+    // the rows of every thief that were not recovered, in stolen order
+    std::unordered_map<int, std::vector<std::size_t>> thief_rows;
+};
+
+#endif // STOLEN_LEDGER_H_
@@ -0,0 +1,853 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "Factory.h"
+#include "FactoryGroup.h"
+#include "FactorySimulator.h"
+
+/*
+ * Micro benchmarks of the factory's hot paths.
+ *
+ * usage: factory_bench <benchmark> [--threads=N] [--ops=N]
+ *   locks   latency of produce and tryBuyOne for every lock policy, with one
+ *           thread and with --threads threads (default 64)
+ *   probes  tryBuyOne throughput of --threads threads when the probes fail
+ *           (empty, closed, company inside) and when they succeed
+ *   admission  wait of small and large company orders under every admission
+ *              policy, --threads companies place --ops/100 orders in total
+ *              while one producer adds a product every 20 microseconds
+ *   layout  --threads probers poll tryBuyOne while a company is inside and
+ *           one worker produces and buys, reports throughput and, when the
+ *           kernel allows perf counters, cache misses per operation. Build
+ *           with -DFACTORY_PACKED_LAYOUT to compare with the unpadded layout
+ *   group   FactoryGroup of 1, 10, 100 and 1000 factories with --threads
+ *           workers, --ops/10 company orders routed over factories of which
+ *           only every tenth was stocked, rebalanced every millisecond
+ *   hotpaths  single thread cost of a simple buy and of a company visit that
+ *             returns its product, build with -DFACTORY_WITHOUT_THIEVES and
+ *             -DFACTORY_WITHOUT_RETURNS to compare the feature sets
+ *   copies    heap allocations of company visits that buy and return 1, 16
+ *             and 256 products, the products move between lists without
+ *             being copied
+ *   shutdown  time to shut down a factory with --ops/20 company buyers
+ *             parked on an empty inventory
+ *   staging   throughput of --threads producers calling produce(1) while
+ *             one buyer empties the factory, without and with staging
+ *   index     cost of the product index with --ops products (try 10000000):
+ *             insert, find and erase on their own, then produce, recall of
+ *             1000 random ids and buying, next to finding one id by
+ *             scanning listAvailableProducts
+ *   recover   time for recoverStolen to give back the 100 products of one
+ *             thief out of ledgers of 10^4 up to --ops stolen products
+ *   ingest    ingestion of a file of --ops records (try 20000000), read
+ *             into Product arrays that are passed to produce, and mapped
+ *             by produceFromFile, with the file in the page cache
+ *   simulate  events per second of FactorySimulator on a synthetic
+ *             workload of about --ops arrivals, under every admission
+ *             policy, with the waits it reports
+ *   handoff   --threads companies place --ops/10 orders of 4 products while
+ *             one producer adds 4 at a time to a factory of capacity 64,
+ *             without and with hand-offs, reports products/s, the share of
+ *             products handed straight to a waiting order and order waits
+ */
+
+// counts the allocations of the calling thread, for the copies benchmark
+thread_local long thread_allocations = 0;
+
+void *operator new(std::size_t size) {
+    thread_allocations++;
+    void *memory = std::malloc(size == 0 ? 1 : size);
+    if (memory == nullptr) throw std::bad_alloc();
+    return memory;
+}
+
+void operator delete(void *memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    Options() : threads(64), ops(200000) {}
+
+    int threads;
+    long ops;
+};
+
+struct Latencies {
+    double mean_ns;
+    double p50_ns;
+    double p99_ns;
+};
+
+// only every SAMPLE_EVERY-th operation is timed, to keep the clock cheap
+const int SAMPLE_EVERY = 8;
+
+Latencies summarize(std::vector<double> &samples, double total_ns,
+                    long total_ops) {
+    Latencies latencies;
+    latencies.mean_ns = total_ns / total_ops;
+    if (samples.empty()) {
+        latencies.p50_ns = latencies.p99_ns = 0;
+        return latencies;
+    }
+    std::sort(samples.begin(), samples.end());
+    latencies.p50_ns = samples[samples.size() / 2];
+    latencies.p99_ns = samples[samples.size() * 99 / 100];
+    return latencies;
+}
+
+void printLatencies(const std::string &name, const Latencies &latencies) {
+    std::cout << "  " << name << ": mean " << latencies.mean_ns
+              << " ns, p50 " << latencies.p50_ns << " ns, p99 "
+              << latencies.p99_ns << " ns" << std::endl;
+}
+
+/*
+ * Every thread alternates produce(1) and tryBuyOne() on the same factory.
+ * The mean is the thread time per operation, so it includes time spent
+ * waiting for the lock.
+ */
+void runProduceBuy(Factory &factory, int threads, long ops_per_thread,
+                   Latencies *produce, Latencies *buy) {
+    std::vector<std::vector<double>> produce_samples(threads);
+    std::vector<std::vector<double>> buy_samples(threads);
+    std::vector<double> produce_ns(threads), buy_ns(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            Product product(t, t);
+            for (long i = 0; i < ops_per_thread; ++i) {
+                auto start = Clock::now();
+                factory.produce(1, &product);
+                auto produced = Clock::now();
+                factory.tryBuyOne();
+                auto bought = Clock::now();
+                double produce_time =
+                        std::chrono::duration<double, std::nano>(
+                                produced - start).count();
+                double buy_time = std::chrono::duration<double, std::nano>(
+                        bought - produced).count();
+                produce_ns[t] += produce_time;
+                buy_ns[t] += buy_time;
+                if (i % SAMPLE_EVERY == 0) {
+                    produce_samples[t].push_back(produce_time);
+                    buy_samples[t].push_back(buy_time);
+                }
+            }
+        });
+    }
+    for (auto &worker : workers) worker.join();
+    std::vector<double> all_produce, all_buy;
+    double total_produce = 0, total_buy = 0;
+    for (int t = 0; t < threads; ++t) {
+        all_produce.insert(all_produce.end(), produce_samples[t].begin(),
+                           produce_samples[t].end());
+        all_buy.insert(all_buy.end(), buy_samples[t].begin(),
+                       buy_samples[t].end());
+        total_produce += produce_ns[t];
+        total_buy += buy_ns[t];
+    }
+    *produce = summarize(all_produce, total_produce, threads * ops_per_thread);
+    *buy = summarize(all_buy, total_buy, threads * ops_per_thread);
+}
+
+void benchLocks(const Options &options) {
+    const FactoryLock::Policy policies[] = {
+            FactoryLock::PTHREAD_MUTEX, FactoryLock::SPIN_THEN_PARK,
+            FactoryLock::TICKET, FactoryLock::MCS};
+    for (auto policy : policies) {
+        std::cout << FactoryLock::policyName(policy) << std::endl;
+        Latencies produce, buy;
+        {
+            Factory factory(policy);
+            runProduceBuy(factory, 1, options.ops, &produce, &buy);
+        }
+        printLatencies("uncontended produce", produce);
+        printLatencies("uncontended tryBuyOne", buy);
+        {
+            Factory factory(policy);
+            runProduceBuy(factory, options.threads,
+                          options.ops / options.threads + 1, &produce, &buy);
+        }
+        printLatencies(std::to_string(options.threads) + " threads produce",
+                       produce);
+        printLatencies(std::to_string(options.threads) +
+                       " threads tryBuyOne", buy);
+    }
+}
+
+/*
+ * Runs tryBuyOne on threads threads until every thread made ops_per_thread
+ * probes, and returns the total number of probes per second.
+ */
+double probeRate(Factory &factory, int threads, long ops_per_thread) {
+    std::vector<std::thread> workers;
+    auto start = Clock::now();
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&factory, ops_per_thread]() {
+            for (long i = 0; i < ops_per_thread; ++i) factory.tryBuyOne();
+        });
+    }
+    for (auto &worker : workers) worker.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start)
+            .count();
+    return threads * ops_per_thread / seconds;
+}
+
+void benchProbes(const Options &options) {
+    long ops_per_thread = options.ops / options.threads + 1;
+    {
+        Factory factory;
+        std::cout << "empty factory: "
+                  << probeRate(factory, options.threads, ops_per_thread)
+                  << " probes/s" << std::endl;
+    }
+    {
+        Factory factory;
+        Product product(1, 1);
+        factory.produce(1, &product);
+        factory.closeFactory();
+        std::cout << "closed factory: "
+                  << probeRate(factory, options.threads, ops_per_thread)
+                  << " probes/s" << std::endl;
+    }
+    {
+        Factory factory;
+        Product product(1, 1);
+        factory.produce(1, &product);
+        // the company waits for a second product, blocking simple buyers
+        factory.startCompanyBuyer(2, 0, 1);
+        std::cout << "company inside: "
+                  << probeRate(factory, options.threads, ops_per_thread)
+                  << " probes/s" << std::endl;
+        factory.produce(1, &product);
+        factory.finishCompanyBuyer(1);
+    }
+    {
+        Factory factory;
+        std::vector<Product> products(options.threads * ops_per_thread);
+        for (std::size_t i = 0; i < products.size(); ++i) {
+            products[i] = Product(static_cast<int>(i), 1);
+        }
+        factory.produce(static_cast<int>(products.size()), products.data());
+        std::cout << "successful buys: "
+                  << probeRate(factory, options.threads, ops_per_thread)
+                  << " buys/s" << std::endl;
+    }
+}
+
+/*
+ * Every LARGE_ORDER_EVERY-th order is for LARGE_ORDER products, the others
+ * are for one product. The producer is slower than the companies, so the
+ * orders compete for the products.
+ */
+const int LARGE_ORDER = 16;
+const int LARGE_ORDER_EVERY = 10;
+
+void runAdmission(Factory::AdmissionPolicy policy, const Options &options) {
+    Factory factory;
+    factory.setAdmissionPolicy(policy, 5);
+    std::atomic<long> orders_left(options.ops / 100);
+    std::atomic<bool> buying(true);
+    std::vector<std::vector<double>> small_waits(options.threads);
+    std::vector<std::vector<double>> large_waits(options.threads);
+    std::thread producer([&factory, &buying]() {
+        Product product(1, 1);
+        while (buying) {
+            factory.produce(1, &product);
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+        }
+    });
+    std::vector<std::thread> companies;
+    for (int t = 0; t < options.threads; ++t) {
+        companies.emplace_back([&, t]() {
+            long order;
+            while ((order = orders_left.fetch_sub(1)) > 0) {
+                bool large = order % LARGE_ORDER_EVERY == 0;
+                auto start = Clock::now();
+                factory.buyProducts(large ? LARGE_ORDER : 1);
+                double wait = std::chrono::duration<double, std::nano>(
+                        Clock::now() - start).count();
+                (large ? large_waits : small_waits)[t].push_back(wait);
+            }
+        });
+    }
+    for (auto &company : companies) company.join();
+    buying = false;
+    producer.join();
+    std::cout << Factory::admissionPolicyName(policy) << std::endl;
+    const char *names[] = {"small orders", "large orders"};
+    std::vector<std::vector<double>> *waits[] = {&small_waits, &large_waits};
+    for (int i = 0; i < 2; ++i) {
+        std::vector<double> all;
+        double total = 0;
+        for (auto &thread_waits : *waits[i]) {
+            all.insert(all.end(), thread_waits.begin(), thread_waits.end());
+        }
+        for (double wait : all) total += wait;
+        if (all.empty()) continue;
+        Latencies latencies = summarize(all, total, all.size());
+        printLatencies(names[i], latencies);
+        std::cout << "  " << names[i] << ": max " << all.back() << " ns"
+                  << std::endl;
+    }
+}
+
+void benchAdmission(const Options &options) {
+    const Factory::AdmissionPolicy policies[] = {
+            Factory::GREEDY, Factory::FIFO, Factory::AGING,
+            Factory::MAX_WAIT};
+    for (auto policy : policies) runAdmission(policy, options);
+}
+
+/*
+ * Counts the hardware cache misses of this process and of the threads it
+ * starts after start(). Counting is off if perf_event_open is not allowed.
+ */
+class CacheMissCounter {
+public:
+    CacheMissCounter() : fd(-1) {
+        struct perf_event_attr attributes;
+        std::memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+        attributes.disabled = 1;
+        attributes.inherit = 1;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1,
+                                      -1, 0));
+    }
+
+    ~CacheMissCounter() {
+        if (fd >= 0) close(fd);
+    }
+
+    bool available() const {
+        return fd >= 0;
+    }
+
+    void start() {
+        if (fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    // the misses since start(), counted threads must have been joined
+    long long stop() {
+        long long misses = 0;
+        if (fd < 0) return 0;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) return 0;
+        return misses;
+    }
+
+private:
+    int fd;
+};
+
+void benchLayout(const Options &options) {
+#ifdef FACTORY_PACKED_LAYOUT
+    std::cout << "packed layout" << std::endl;
+#else
+    std::cout << "cache line aligned layout" << std::endl;
+#endif
+    std::cout << "sizeof(Factory) " << sizeof(Factory) << " bytes"
+              << std::endl;
+    Factory factory;
+    // a waiting company keeps the probes failing on the read-mostly fields,
+    // the inventory never gets large enough for its order during the run
+    const int blocking_order = 1000;
+    factory.startCompanyBuyer(blocking_order, 0, 1);
+    long worker_ops = options.ops;
+    long probes_per_thread = options.ops * 4 / options.threads + 1;
+    CacheMissCounter counter;
+    counter.start();
+    auto start = Clock::now();
+    std::thread worker([&factory, worker_ops]() {
+        Product product(1, 1);
+        for (long i = 0; i < worker_ops; ++i) {
+            factory.produce(1, &product);
+            factory.buyProducts(1);
+        }
+    });
+    std::vector<std::thread> probers;
+    for (int t = 0; t < options.threads; ++t) {
+        probers.emplace_back([&factory, probes_per_thread]() {
+            for (long i = 0; i < probes_per_thread; ++i) factory.tryBuyOne();
+        });
+    }
+    for (auto &prober : probers) prober.join();
+    worker.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start)
+            .count();
+    long long misses = counter.stop();
+    long long operations = worker_ops * 2 + options.threads *
+                                            probes_per_thread;
+    std::cout << "worker: " << worker_ops * 2 / seconds << " ops/s"
+              << std::endl;
+    std::cout << "probers: " << options.threads * probes_per_thread / seconds
+              << " probes/s" << std::endl;
+    if (counter.available()) {
+        std::cout << "cache misses: " << static_cast<double>(misses) /
+                                         operations << " per operation"
+                  << std::endl;
+    } else {
+        std::cout << "cache misses: perf counters unavailable, try "
+                     "perf stat -e cache-misses" << std::endl;
+    }
+    std::vector<Product> order(blocking_order, Product(1, 1));
+    factory.produce(blocking_order, order.data());
+    factory.finishCompanyBuyer(1);
+}
+
+void benchGroup(const Options &options) {
+    const std::size_t sizes[] = {1, 10, 100, 1000};
+    long orders = options.ops / 10;
+    for (std::size_t num_factories : sizes) {
+        FactoryGroup group(num_factories, options.threads, 1);
+        // twice the largest possible demand, in every tenth factory
+        std::size_t stocked = (num_factories + 9) / 10;
+        std::vector<Product> stock(orders * 4 * 2 / stocked + 1,
+                                   Product(1, 1));
+        for (std::size_t i = 0; i < num_factories; i += 10) {
+            group.factory(i).produce(static_cast<int>(stock.size()),
+                                     stock.data());
+        }
+        auto start = Clock::now();
+        for (long i = 0; i < orders; ++i) {
+            group.submitCompanyOrder(static_cast<int>(i % 4) + 1, 0);
+        }
+        group.waitIdle();
+        double seconds = std::chrono::duration<double>(Clock::now() - start)
+                .count();
+        FactoryGroupStats stats = group.getStats();
+        std::cout << num_factories << " factories: " << orders / seconds
+                  << " orders/s, " << stats.products_rebalanced
+                  << " products rebalanced" << std::endl;
+    }
+}
+
+void benchHotPaths(const Options &options) {
+    std::cout << "thieves " << (FactoryFeatures::THIEVES ? "on" : "off")
+              << ", returns " << (FactoryFeatures::RETURNS ? "on" : "off")
+              << std::endl;
+    Factory factory;
+    Product product(1, 1);
+    auto start = Clock::now();
+    for (long i = 0; i < options.ops; ++i) {
+        factory.produce(1, &product);
+        factory.tryBuyOne();
+    }
+    double simple_ns = std::chrono::duration<double, std::nano>(
+            Clock::now() - start).count() / options.ops;
+    factory.produce(1, &product);
+    start = Clock::now();
+    for (long i = 0; i < options.ops; ++i) {
+        // the product is worth less than 2, so it is always returned
+        factory.runCompanyBuyer(1, 2, 1);
+    }
+    double company_ns = std::chrono::duration<double, std::nano>(
+            Clock::now() - start).count() / options.ops;
+    std::cout << "  produce and tryBuyOne: " << simple_ns << " ns"
+              << std::endl;
+    std::cout << "  company visit with a return: " << company_ns << " ns"
+              << std::endl;
+}
+
+void benchCopies(const Options &options) {
+    const int sizes[] = {1, 16, 256};
+    for (int size : sizes) {
+        Factory factory;
+        // unique ids, repeated ids would measure the index's duplicates
+        std::vector<Product> products;
+        for (int i = 0; i < size; ++i) products.emplace_back(i + 1, 1);
+        factory.produce(size, products.data());
+        long visits = options.ops / size + 1;
+        long before = thread_allocations;
+        auto start = Clock::now();
+        for (long i = 0; i < visits; ++i) {
+            // every product is worth less than 2, so all of them come back
+            factory.runCompanyBuyer(size, 2, 1);
+        }
+        double visit_ns = std::chrono::duration<double, std::nano>(
+                Clock::now() - start).count() / visits;
+        std::cout << size << " products: "
+                  << static_cast<double>(thread_allocations - before) / visits
+                  << " allocations and " << visit_ns << " ns per visit"
+                  << std::endl;
+    }
+}
+
+void benchShutdown(const Options &options) {
+    long parked = options.ops / 20;
+    Factory factory;
+    for (long i = 0; i < parked; ++i) {
+        factory.startCompanyBuyer(1, 0, static_cast<unsigned int>(i));
+    }
+    // give every company time to reach its wait
+    std::this_thread::sleep_for(std::chrono::milliseconds(parked / 10 + 100));
+    auto start = Clock::now();
+    ShutdownStatus status = factory.shutdown(0);
+    double ms = std::chrono::duration<double, std::milli>(Clock::now() - start)
+            .count();
+    std::cout << status.cancelled << " parked visitors cancelled, "
+              << status.joined << " joined in " << ms << " ms" << std::endl;
+}
+
+void benchStaging(const Options &options) {
+    const std::size_t batches[] = {0, 16, 256};
+    long ops_per_thread = options.ops / options.threads + 1;
+    for (std::size_t batch : batches) {
+        Factory factory;
+        factory.setStaging(batch, 1);
+        std::atomic<bool> producing(true);
+        std::thread buyer([&factory, &producing]() {
+            int results[64];
+            while (producing) factory.tryBuyMany(64, results);
+        });
+        auto start = Clock::now();
+        std::vector<std::thread> producers;
+        for (int t = 0; t < options.threads; ++t) {
+            producers.emplace_back([&factory, ops_per_thread, t]() {
+                Product product(t, 1);
+                for (long i = 0; i < ops_per_thread; ++i) {
+                    factory.produce(1, &product);
+                }
+            });
+        }
+        for (auto &producer : producers) producer.join();
+        double seconds = std::chrono::duration<double>(Clock::now() - start)
+                .count();
+        producing = false;
+        buyer.join();
+        std::cout << "batch " << batch << ": "
+                  << options.threads * ops_per_thread / seconds
+                  << " products/s" << std::endl;
+    }
+}
+
+double nsPerOp(Clock::time_point start, long ops) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start)
+            .count() / ops;
+}
+
+void benchIndex(const Options &options) {
+    long size = options.ops;
+    std::mt19937 random(1);
+    std::vector<int> lookups(1000);
+    for (auto &id : lookups) id = static_cast<int>(random() % size) + 1;
+    {
+        std::list<Product> products;
+        for (long i = 0; i < size; ++i) {
+            products.push_back(Product(static_cast<int>(i + 1), 1));
+        }
+        ProductIndex index;
+        auto start = Clock::now();
+        for (auto i = products.begin(); i != products.end(); ++i) {
+            index.insert(i->getId(), i);
+        }
+        double insert_ns = nsPerOp(start, size);
+        start = Clock::now();
+        ProductIndex::Position position;
+        long found = 0;
+        for (int round = 0; round < 1000; ++round) {
+            for (int id : lookups) found += index.find(id, &position);
+        }
+        double find_ns = nsPerOp(start, 1000 * lookups.size());
+        std::size_t bytes = index.memoryBytes();
+        start = Clock::now();
+        for (auto i = products.begin(); i != products.end(); ++i) {
+            index.erase(i->getId(), i);
+        }
+        double erase_ns = nsPerOp(start, size);
+        std::cout << "index of " << size << " products: " << bytes / 1048576
+                  << " MiB, insert " << insert_ns << " ns, find " << find_ns
+                  << " ns (" << found / 1000 << " found), erase " << erase_ns
+                  << " ns" << std::endl;
+    }
+    Factory factory;
+    std::vector<Product> batch(1024);
+    auto start = Clock::now();
+    for (long produced = 0; produced < size;) {
+        int count = static_cast<int>(std::min<long>(1024, size - produced));
+        for (int i = 0; i < count; ++i) {
+            batch[i] = Product(static_cast<int>(produced + i + 1), 1);
+        }
+        factory.produce(count, batch.data());
+        produced += count;
+    }
+    double produce_ns = nsPerOp(start, size);
+    start = Clock::now();
+    std::list<Product> copy = factory.listAvailableProducts();
+    auto scanned = std::find_if(copy.begin(), copy.end(),
+                                [&lookups](const Product &product) {
+                                    return product.getId() == lookups[0];
+                                });
+    double scan_ms = std::chrono::duration<double, std::milli>(
+            Clock::now() - start).count();
+    start = Clock::now();
+    RecallReport report = factory.recallProducts(lookups);
+    double recall_ns = nsPerOp(start, lookups.size());
+    start = Clock::now();
+    long bought = 0;
+    while (!factory.takeProducts(1024).empty()) bought += 1024;
+    double buy_ns = nsPerOp(start, size);
+    std::cout << "factory: produce " << produce_ns << " ns per product, "
+              << "recall " << recall_ns << " ns per id ("
+              << report.recalled.size() << " recalled), takeProducts "
+              << buy_ns << " ns per product" << std::endl;
+    std::cout << "finding one id by copy and scan: " << scan_ms << " ms"
+              << (scanned == copy.end() ? " (missing)" : "") << std::endl;
+}
+
+void benchRecover(const Options &options) {
+    for (long size = 10000; size <= options.ops; size *= 10) {
+        Factory factory;
+        std::vector<Product> products(size, Product(1, 1));
+        factory.produce(static_cast<int>(size), products.data());
+        // thief 0 steals 100 products among thieves of 1000 each
+        factory.startThief(100, 0);
+        factory.finishThief(0);
+        for (unsigned int thief = 1; thief * 1000 <= size - 100; ++thief) {
+            factory.startThief(1000, thief);
+            factory.finishThief(thief);
+        }
+        auto start = Clock::now();
+        std::size_t recovered = factory.recoverStolen(0);
+        double us = std::chrono::duration<double, std::micro>(
+                Clock::now() - start).count();
+        std::cout << "ledger of " << factory.getStats().stolen_products +
+                                     recovered
+                  << ": " << recovered << " recovered in " << us << " us"
+                  << std::endl;
+    }
+}
+
+void benchIngest(const Options &options) {
+    std::string path = "/tmp/factory_bench_products";
+    {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        std::vector<int32_t> records(2 * 65536);
+        for (long written = 0; written < options.ops;) {
+            long count = std::min<long>(65536, options.ops - written);
+            for (long i = 0; i < count; ++i) {
+                records[2 * i] = static_cast<int32_t>(written + i + 1);
+                records[2 * i + 1] = 1;
+            }
+            if (write(fd, records.data(), count * 8) != count * 8) {
+                std::cerr << "can not write " << path << std::endl;
+                return;
+            }
+            written += count;
+        }
+        close(fd);
+    }
+    double megabytes = options.ops * 8 / 1e6;
+    for (int round = 0; round < 2; ++round) {
+        double array_seconds;
+        {
+            Factory factory;
+            auto start = Clock::now();
+            int fd = open(path.c_str(), O_RDONLY);
+            std::vector<int32_t> records(2 * 65536);
+            std::vector<Product> products(65536);
+            ssize_t bytes;
+            while ((bytes = read(fd, records.data(), records.size() * 4)) > 0) {
+                int count = static_cast<int>(bytes / 8);
+                for (int i = 0; i < count; ++i) {
+                    products[i] = Product(records[2 * i], records[2 * i + 1]);
+                }
+                factory.produce(count, products.data());
+            }
+            close(fd);
+            array_seconds = std::chrono::duration<double>(Clock::now() - start)
+                    .count();
+        }
+        double mapped_seconds;
+        {
+            Factory factory;
+            auto start = Clock::now();
+            factory.produceFromFile(path);
+            mapped_seconds = std::chrono::duration<double>(
+                    Clock::now() - start).count();
+        }
+        std::cout << "read + produce: " << megabytes / array_seconds
+                  << " MB/s, produceFromFile: " << megabytes / mapped_seconds
+                  << " MB/s (" << options.ops / mapped_seconds / 1e6
+                  << " M products/s)" << std::endl;
+    }
+    unlink(path.c_str());
+}
+
+void benchSimulate(const Options &options) {
+    FactorySimulator::SyntheticWorkload workload;
+    // about --ops arrivals in 10 simulated seconds
+    workload.duration_ns = 10000000000LL;
+    double rate = options.ops / 10.0;
+    // demand slightly above supply, with orders large enough for the
+    // admission policies to matter
+    workload.producer_rate = rate * 0.5;
+    workload.producer_batch = 4;
+    workload.simple_buyer_rate = rate * 0.44;
+    workload.company_rate = rate * 0.05;
+    workload.max_company_order = 64;
+    workload.company_returns = 1;
+    workload.thief_rate = rate * 0.01;
+    workload.thief_size = 4;
+    workload.close_every_ns = 1000000000LL;
+    workload.closed_ns = 50000000LL;
+    std::vector<FactorySimulator::Arrival> arrivals =
+            FactorySimulator::generate(workload);
+    const Factory::AdmissionPolicy policies[] = {
+            Factory::GREEDY, Factory::FIFO, Factory::AGING,
+            Factory::MAX_WAIT};
+    for (auto policy : policies) {
+        FactorySimulator simulator(1000, policy, 1);
+        auto start = Clock::now();
+        FactorySimulator::Report report = simulator.run(arrivals);
+        double seconds = std::chrono::duration<double>(Clock::now() - start)
+                .count();
+        std::cout << Factory::admissionPolicyName(policy) << ": "
+                  << report.events / seconds / 1e6 << " M events/s, "
+                  << "company wait mean " << report.companies.mean_wait_ns / 1e3
+                  << " us p99 " << report.companies.p99_wait_ns / 1e3
+                  << " us, mean queue " << report.companies.mean_queue
+                  << ", simple buyers turned away "
+                  << report.simple_failures << "/"
+                  << report.simple_buys + report.simple_failures << std::endl;
+    }
+}
+
+const int HANDOFF_ORDER = 4;
+
+void benchHandOff(const Options &options) {
+    for (bool hand_off : {false, true}) {
+        Factory factory;
+        factory.setHandOff(hand_off);
+        factory.setCapacity(64);
+        std::atomic<long> orders_left(options.ops / 10);
+        std::atomic<bool> buying(true);
+        std::vector<std::vector<double>> waits(options.threads);
+        std::thread producer([&factory, &buying]() {
+            Product products[HANDOFF_ORDER];
+            for (int i = 0; i < HANDOFF_ORDER; ++i) {
+                products[i] = Product(i, 1);
+            }
+            while (buying) {
+                factory.produceFor(HANDOFF_ORDER, products, 10);
+            }
+        });
+        auto start = Clock::now();
+        std::vector<std::thread> companies;
+        for (int t = 0; t < options.threads; ++t) {
+            companies.emplace_back([&, t]() {
+                while (orders_left.fetch_sub(1) > 0) {
+                    auto order_start = Clock::now();
+                    factory.buyProducts(HANDOFF_ORDER);
+                    waits[t].push_back(std::chrono::duration<double, std::nano>(
+                            Clock::now() - order_start).count());
+                }
+            });
+        }
+        for (auto &company : companies) company.join();
+        double seconds = std::chrono::duration<double>(Clock::now() - start)
+                .count();
+        buying = false;
+        producer.join();
+        std::vector<double> all;
+        double total = 0;
+        for (auto &thread_waits : waits) {
+            all.insert(all.end(), thread_waits.begin(), thread_waits.end());
+        }
+        for (double wait : all) total += wait;
+        double bought = static_cast<double>(all.size()) * HANDOFF_ORDER;
+        std::cout << (hand_off ? "hand-off" : "inventory") << ": "
+                  << bought / seconds << " products/s, "
+                  << 100.0 * factory.getStats().handed_off / bought
+                  << "% handed off" << std::endl;
+        if (!all.empty()) {
+            printLatencies("order wait", summarize(all, total, all.size()));
+        }
+    }
+}
+
+bool parseOptions(int argc, char **argv, Options *options) {
+    for (int i = 2; i < argc; ++i) {
+        if (std::strncmp(argv[i], "--threads=", 10) == 0) {
+            options->threads = std::atoi(argv[i] + 10);
+        } else if (std::strncmp(argv[i], "--ops=", 6) == 0) {
+            options->ops = std::atol(argv[i] + 6);
+        } else {
+            return false;
+        }
+    }
+    return options->threads > 0 && options->ops > 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (argc < 2 || !parseOptions(argc, argv, &options)) {
+        std::cerr << "usage: " << argv[0]
+                  << " <benchmark> [--threads=N] [--ops=N]" << std::endl;
+        return 2;
+    }
+    std::string benchmark = argv[1];
+    if (benchmark == "locks") {
+        benchLocks(options);
+    } else if (benchmark == "probes") {
+        benchProbes(options);
+    } else if (benchmark == "admission") {
+        benchAdmission(options);
+    } else if (benchmark == "layout") {
+        benchLayout(options);
+    } else if (benchmark == "group") {
+        benchGroup(options);
+    } else if (benchmark == "hotpaths") {
+        benchHotPaths(options);
+    } else if (benchmark == "copies") {
+        benchCopies(options);
+    } else if (benchmark == "shutdown") {
+        benchShutdown(options);
+    } else if (benchmark == "staging") {
+        benchStaging(options);
+    } else if (benchmark == "index") {
+        benchIndex(options);
+    } else if (benchmark == "recover") {
+        benchRecover(options);
+    } else if (benchmark == "ingest") {
+        benchIngest(options);
+    } else if (benchmark == "simulate") {
+        benchSimulate(options);
+    } else if (benchmark == "handoff") {
+        benchHandOff(options);
+    } else {
+        std::cerr << "unknown benchmark " << benchmark << std::endl;
+        return 2;
+    }
+    return 0;
+}
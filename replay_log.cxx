@@ -0,0 +1,38 @@
+#include <iostream>
+#include "EventLog.h"
+
+/*
+ * Rebuilds a factory's available and stolen products from its event log.
+ * usage: factory_replay <event log> [-v]
+ */
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <event log> [-v]" << std::endl;
+        return 2;
+    }
+    std::list<Product> available_products;
+    std::list<std::pair<Product, int>> stolen_products;
+    long events = EventLog::replay(argv[1], &available_products,
+                                   &stolen_products);
+    if (events < 0) {
+        std::cerr << argv[1] << ": unreadable or corrupted event log"
+                  << std::endl;
+        return 1;
+    }
+    std::cout << "events: " << events << std::endl;
+    std::cout << "available products: " << available_products.size()
+              << std::endl;
+    std::cout << "stolen products: " << stolen_products.size() << std::endl;
+    if (argc > 2 && std::string(argv[2]) == "-v") {
+        for (auto &product : available_products) {
+            std::cout << "available " << product.getId() << " "
+                      << product.getValue() << std::endl;
+        }
+        for (auto &stolen : stolen_products) {
+            std::cout << "stolen " << stolen.first.getId() << " "
+                      << stolen.first.getValue() << " " << stolen.second
+                      << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,458 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Factory.h"
+
+/*
+ * Load generator for the factory.
+ * Starts visitors of every class at a configurable rate and mix for a fixed
+ * duration, then drains the factory, checks that no product was lost or
+ * duplicated and reports the sustained throughput.
+ *
+ * usage: factory_stress [--option=value ...]
+ *   --duration=SEC          how long visitors keep arriving (default 5)
+ *   --inventory=N           products in the factory before the run (0)
+ *   --mix=P,C,S,T           weights of producers, company buyers, simple
+ *                           buyers and thieves among arrivals (4,2,4,1)
+ *   --rate=R                arrivals per second, 0 for no limit (0)
+ *   --arrivals=KIND         constant or poisson inter-arrival times
+ *   --order=DIST            order sizes of producers, companies and thieves:
+ *                           fixed:N, uniform:A:B or geometric:MEAN
+ *                           (uniform:1:20)
+ *   --max-in-flight=N       visitors running at the same time, and
+ *                           companies waiting before the run pauses to
+ *                           stock and join them (256)
+ *   --seed=S                random seed (1)
+ *   --event-log=PATH        log the factory's events to PATH
+ *   --durability=KIND       none, periodic or batch (batch)
+ *   --admission=POLICY      greedy, fifo, aging:MS or max-wait:MS (greedy)
+ *   --reservations=on|off   company buyers claim products as they come (off)
+ *   --pin=on|off            pin visitors to NUMA nodes in turn (off)
+ *   --staging=N             producers publish in batches of N products, or
+ *                           after a millisecond (0, publish every call)
+ */
+
+namespace {
+
+struct Options {
+    Options() : duration_s(5), inventory(0), rate(0), poisson(false),
+                order_kind("uniform"), order_a(1), order_b(20),
+                max_in_flight(256), seed(1),
+                durability(EventLog::SYNC_EVERY_BATCH),
+                admission(Factory::GREEDY), admission_bound_ms(0),
+                reservations(false), pin(false), staging(0) {
+        // supply a little above demand, so thieves do not keep the stock
+        // at zero and companies get served
+        mix[0] = 4;
+        mix[1] = 2;
+        mix[2] = 4;
+        mix[3] = 1;
+    }
+
+    double duration_s;
+    long long inventory;
+    double mix[4];
+    double rate;
+    bool poisson;
+    std::string order_kind;
+    double order_a;
+    double order_b;
+    std::size_t max_in_flight;
+    unsigned int seed;
+    std::string event_log;
+    EventLog::Durability durability;
+    Factory::AdmissionPolicy admission;
+    long admission_bound_ms;
+    bool reservations;
+    bool pin;
+    std::size_t staging;
+};
+
+enum Role {
+    PRODUCER = 0,
+    COMPANY = 1,
+    SIMPLE = 2,
+    THIEF = 3
+};
+
+struct Visitor {
+    Role role;
+    unsigned int id;
+    int num_products;
+    std::unique_ptr<std::vector<Product>> products;
+};
+
+struct Totals {
+    Totals() : started(), produced(0), company_bought(0), returned(0),
+               simple_bought(0), simple_failed(0), stolen(0),
+               settles(0) {}
+
+    long long started[4];
+    long long produced;
+    long long company_bought;
+    long long returned;
+    long long simple_bought;
+    long long simple_failed;
+    long long stolen;
+    // times the waiting companies were released to make room, see settle
+    long long settles;
+};
+
+bool parseOptions(int argc, char **argv, Options *options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+            return false;
+        }
+        std::string key = arg.substr(2, eq - 2);
+        std::string value = arg.substr(eq + 1);
+        if (key == "duration") {
+            options->duration_s = std::atof(value.c_str());
+        } else if (key == "inventory") {
+            options->inventory = std::atoll(value.c_str());
+        } else if (key == "mix") {
+            if (std::sscanf(value.c_str(), "%lf,%lf,%lf,%lf", &options->mix[0],
+                            &options->mix[1], &options->mix[2],
+                            &options->mix[3]) != 4) {
+                return false;
+            }
+        } else if (key == "rate") {
+            options->rate = std::atof(value.c_str());
+        } else if (key == "arrivals") {
+            if (value != "constant" && value != "poisson") return false;
+            options->poisson = value == "poisson";
+        } else if (key == "order") {
+            auto colon = value.find(':');
+            options->order_kind = value.substr(0, colon);
+            if (colon == std::string::npos) return false;
+            std::string params = value.substr(colon + 1);
+            options->order_a = std::atof(params.c_str());
+            auto second = params.find(':');
+            options->order_b = second == std::string::npos ? options->order_a :
+                               std::atof(params.c_str() + second + 1);
+            if (options->order_kind != "fixed" &&
+                options->order_kind != "uniform" &&
+                options->order_kind != "geometric") {
+                return false;
+            }
+        } else if (key == "max-in-flight") {
+            options->max_in_flight = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (key == "seed") {
+            options->seed = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (key == "event-log") {
+            options->event_log = value;
+        } else if (key == "admission") {
+            auto colon = value.find(':');
+            std::string policy = value.substr(0, colon);
+            if (colon != std::string::npos) {
+                options->admission_bound_ms =
+                        std::atol(value.c_str() + colon + 1);
+            }
+            if (policy == "greedy") {
+                options->admission = Factory::GREEDY;
+            } else if (policy == "fifo") {
+                options->admission = Factory::FIFO;
+            } else if (policy == "aging") {
+                options->admission = Factory::AGING;
+            } else if (policy == "max-wait") {
+                options->admission = Factory::MAX_WAIT;
+            } else {
+                return false;
+            }
+        } else if (key == "reservations") {
+            if (value != "on" && value != "off") return false;
+            options->reservations = value == "on";
+        } else if (key == "staging") {
+            options->staging = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (key == "pin") {
+            if (value != "on" && value != "off") return false;
+            options->pin = value == "on";
+        } else if (key == "durability") {
+            if (value == "none") {
+                options->durability = EventLog::NO_SYNC;
+            } else if (value == "periodic") {
+                options->durability = EventLog::SYNC_PERIODIC;
+            } else if (value == "batch") {
+                options->durability = EventLog::SYNC_EVERY_BATCH;
+            } else {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return options->max_in_flight > 0;
+}
+
+class Generator {
+public:
+    explicit Generator(const Options &options)
+            : options(options), random(options.seed),
+              mix(options.mix, options.mix + 4), next_product_id(1),
+              next_visitor_id(1) {}
+
+    int orderSize() {
+        if (options.order_kind == "fixed") {
+            return static_cast<int>(options.order_a);
+        }
+        if (options.order_kind == "uniform") {
+            std::uniform_int_distribution<int> size(
+                    static_cast<int>(options.order_a),
+                    static_cast<int>(options.order_b));
+            return size(random);
+        }
+        std::geometric_distribution<int> size(1.0 / options.order_a);
+        return 1 + size(random);
+    }
+
+    Role role() {
+        return static_cast<Role>(mix(random));
+    }
+
+    // seconds until the next arrival
+    double interArrival() {
+        if (options.rate <= 0) return 0;
+        if (!options.poisson) return 1.0 / options.rate;
+        std::exponential_distribution<double> gap(options.rate);
+        return gap(random);
+    }
+
+    Product nextProduct() {
+        std::uniform_int_distribution<int> value(0, 99);
+        return Product(static_cast<int>(next_product_id++), value(random));
+    }
+
+    unsigned int nextVisitorId() {
+        return next_visitor_id++;
+    }
+
+    long long productsCreated() const {
+        return next_product_id - 1;
+    }
+
+private:
+    const Options &options;
+    std::mt19937 random;
+    std::discrete_distribution<int> mix;
+    long long next_product_id;
+    unsigned int next_visitor_id;
+};
+
+void startVisitor(Factory &factory, Visitor &visitor, Generator &generator,
+                  Totals *totals) {
+    switch (visitor.role) {
+        case PRODUCER:
+            visitor.products.reset(new std::vector<Product>());
+            for (int i = 0; i < visitor.num_products; ++i) {
+                visitor.products->push_back(generator.nextProduct());
+            }
+            factory.startProduction(visitor.num_products,
+                                    visitor.products->data(), visitor.id);
+            break;
+        case COMPANY:
+            factory.startCompanyBuyer(visitor.num_products, 50, visitor.id);
+            break;
+        case SIMPLE:
+            factory.startSimpleBuyer(visitor.id);
+            break;
+        case THIEF:
+            factory.startThief(visitor.num_products, visitor.id);
+            break;
+    }
+    totals->started[visitor.role]++;
+}
+
+void finishVisitor(Factory &factory, Visitor &visitor, Totals *totals) {
+    switch (visitor.role) {
+        case PRODUCER:
+            factory.finishProduction(visitor.id);
+            totals->produced += visitor.num_products;
+            break;
+        case COMPANY:
+            totals->returned += factory.finishCompanyBuyer(visitor.id);
+            totals->company_bought += visitor.num_products;
+            break;
+        case SIMPLE:
+            if (factory.finishSimpleBuyer(visitor.id) == -1) {
+                totals->simple_failed++;
+            } else {
+                totals->simple_bought++;
+            }
+            break;
+        case THIEF:
+            totals->stolen += factory.finishThief(visitor.id);
+            break;
+    }
+}
+
+// fills the factory in chunks, so no array of the whole inventory is needed
+void fillInventory(Factory &factory, Generator &generator, long long count,
+                   Totals *totals) {
+    const long long CHUNK = 1 << 16;
+    std::vector<Product> chunk;
+    chunk.reserve(CHUNK);
+    while (count > 0) {
+        chunk.clear();
+        long long size = count < CHUNK ? count : CHUNK;
+        for (long long i = 0; i < size; ++i) {
+            chunk.push_back(generator.nextProduct());
+        }
+        factory.produce(static_cast<int>(size), chunk.data());
+        totals->produced += size;
+        count -= size;
+    }
+}
+
+/*
+ * Finishes every running visitor, then adds the products the waiting
+ * companies still need and finishes them too. With no thief left, the
+ * added stock releases every company.
+ */
+void settle(Factory &factory, Generator &generator,
+            std::deque<Visitor> *running, std::deque<Visitor> *companies,
+            Totals *totals) {
+    for (auto &visitor : *running) finishVisitor(factory, visitor, totals);
+    running->clear();
+    long long outstanding = 0;
+    for (auto &visitor : *companies) outstanding += visitor.num_products;
+    fillInventory(factory, generator, outstanding, totals);
+    for (auto &visitor : *companies) finishVisitor(factory, visitor, totals);
+    companies->clear();
+}
+
+/*
+ * Every product created must end up exactly once in the factory, in a
+ * buyer's hands or in the stolen products ledger.
+ */
+bool checkInvariants(Factory &factory, const Totals &totals,
+                     long long products_created) {
+    bool ok = true;
+    auto available = factory.listAvailableProducts();
+    long long kept = totals.company_bought - totals.returned +
+                     totals.simple_bought;
+    long long accounted = static_cast<long long>(available.size()) + kept +
+                          totals.stolen;
+    if (totals.produced != products_created) {
+        std::cout << "invariant violated: produced " << totals.produced
+                  << " of " << products_created << " products" << std::endl;
+        ok = false;
+    }
+    if (accounted != totals.produced) {
+        std::cout << "invariant violated: " << totals.produced
+                  << " products produced but " << accounted
+                  << " accounted for" << std::endl;
+        ok = false;
+    }
+    std::vector<bool> seen(static_cast<std::size_t>(products_created) + 1);
+    auto mark = [&seen, &ok](int id) {
+        if (id <= 0 || static_cast<std::size_t>(id) >= seen.size() ||
+            seen[id]) {
+            std::cout << "invariant violated: product " << id
+                      << " is unknown or duplicated" << std::endl;
+            ok = false;
+            return;
+        }
+        seen[id] = true;
+    };
+    for (auto &product : available) mark(product.getId());
+    factory.forEachStolenProduct([&mark](int id, int, int) { mark(id); });
+    return ok;
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parseOptions(argc, argv, &options)) {
+        std::cerr << "bad arguments, see the comment at the top of "
+                     "stress_test.cxx" << std::endl;
+        return 2;
+    }
+    Factory factory;
+    factory.setAdmissionPolicy(options.admission, options.admission_bound_ms);
+    factory.setReservations(options.reservations);
+    factory.setThreadPlacement(options.pin);
+    factory.setStaging(options.staging, 1);
+    if (!options.event_log.empty()) {
+        factory.enableEventLog(options.event_log, options.durability);
+    }
+    Generator generator(options);
+    Totals totals;
+    fillInventory(factory, generator, options.inventory, &totals);
+
+    typedef std::chrono::steady_clock Clock;
+    auto start = Clock::now();
+    auto end = start + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(options.duration_s));
+    auto next_arrival = start;
+    // companies may block for stock, so they are only joined by settle
+    std::deque<Visitor> running;
+    std::deque<Visitor> companies;
+    while (Clock::now() < end) {
+        if (options.rate > 0) std::this_thread::sleep_until(next_arrival);
+        next_arrival += std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(generator.interArrival()));
+        Visitor visitor;
+        visitor.role = generator.role();
+        visitor.id = generator.nextVisitorId();
+        visitor.num_products = visitor.role == SIMPLE ? 1 :
+                               generator.orderSize();
+        if (visitor.role == COMPANY &&
+            companies.size() >= options.max_in_flight) {
+            // joining only at the end would turn every later company away
+            settle(factory, generator, &running, &companies, &totals);
+            totals.settles++;
+        }
+        startVisitor(factory, visitor, generator, &totals);
+        if (visitor.role == COMPANY) {
+            companies.push_back(std::move(visitor));
+        } else {
+            running.push_back(std::move(visitor));
+        }
+        while (running.size() >= options.max_in_flight) {
+            finishVisitor(factory, running.front(), &totals);
+            running.pop_front();
+        }
+    }
+    auto arrivals_done = Clock::now();
+
+    settle(factory, generator, &running, &companies, &totals);
+    factory.publishStaged();
+    factory.flushEventLog();
+    auto drained = Clock::now();
+
+    double seconds = std::chrono::duration<double>(drained - start).count();
+    long long visitors = totals.started[PRODUCER] + totals.started[COMPANY] +
+                         totals.started[SIMPLE] + totals.started[THIEF];
+    long long moved = totals.produced - options.inventory + totals.returned +
+                      totals.company_bought + totals.simple_bought +
+                      totals.stolen;
+    std::cout << "arrivals: "
+              << std::chrono::duration<double>(arrivals_done - start).count()
+              << " s, drained after " << seconds << " s" << std::endl;
+    std::cout << "visitors: " << visitors << " (producers "
+              << totals.started[PRODUCER] << ", companies "
+              << totals.started[COMPANY] << ", simple buyers "
+              << totals.started[SIMPLE] << ", thieves "
+              << totals.started[THIEF] << ", settles " << totals.settles
+              << ")" << std::endl;
+    std::cout << "products: produced " << totals.produced << ", bought "
+              << totals.company_bought + totals.simple_bought
+              << ", returned " << totals.returned << ", stolen "
+              << totals.stolen << ", failed simple buys "
+              << totals.simple_failed << std::endl;
+    std::cout << "throughput: " << visitors / seconds << " visitors/s, "
+              << moved / seconds << " product moves/s" << std::endl;
+    bool ok = checkInvariants(factory, totals, generator.productsCreated());
+    std::cout << "invariants: " << (ok ? "ok" : "VIOLATED") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -1,10 +1,11 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <iostream>
+#include <vector>
 #include "Factory.h"
 #include "test_utilities.h"
 
-#define TEST_SYNC_SIZE 100 // this is not recommended to increase this parameter.
+#define TEST_SYNC_SIZE 100 // for bigger loads use factory_stress instead
 #define STRESS_TEST_SIZE 10000 // with this parameter you can do whatever you
 // want
 
@@ -361,7 +362,9 @@ bool testReusingIds() {
 
 bool testSync() {
     Factory factory = Factory();
-    Product allProducts[TEST_SYNC_SIZE][TEST_SYNC_SIZE];
+    // on the heap, so TEST_SYNC_SIZE is not bounded by the stack size
+    vector<vector<Product>> allProducts(TEST_SYNC_SIZE,
+                                        vector<Product>(TEST_SYNC_SIZE));
     int id = 1;
     for (int i = 2; i < TEST_SYNC_SIZE; i++) {
         for (int j = 0; j < i; j++) {
@@ -370,7 +373,7 @@ bool testSync() {
     }
 
     for (int i = 2; i < TEST_SYNC_SIZE; i++) {
-        Product *products = allProducts[i];
+        Product *products = allProducts[i].data();
         factory.startProduction(i, products, i);
         factory.startCompanyBuyer(i, TEST_SYNC_SIZE, TEST_SYNC_SIZE + i);
         factory.startSimpleBuyer(10 * TEST_SYNC_SIZE + i);